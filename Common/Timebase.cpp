@@ -0,0 +1,46 @@
+/*
+ * Timebase.cpp
+ *
+ * Created: 17/10/2026 09.14.02
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+#include "Timebase.hpp"
+#include <avr/io.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+static portTickType lastTicks_ = 0;	// Tick count seen by the previous call
+static uint16_t tickWraps_ = 0;		// Times the 16-bit tick count has wrapped, upper half of the 32-bit tick count
+
+uint32_t Timebase::Micros()
+{
+	uint16_t count;
+	portTickType ticks;
+	uint32_t ticks32;
+
+	portENTER_CRITICAL();
+
+	ticks = xTaskGetTickCount();
+	count = TCNT5;
+
+	/* Compare match happened after interrupts were disabled, so the tick hasn't been counted yet */
+	if ((TIFR5 & (1<<OCF5A)) && count < (OCR5A >> 1))
+		ticks++;
+
+	/* Extend the tick count to 32 bits, so the result wraps at 2^32 us like a plain counter would */
+	if (ticks < lastTicks_)
+		tickWraps_++;
+	lastTicks_ = ticks;
+	ticks32 = ((uint32_t)tickWraps_ << 16) | ticks;
+
+	portEXIT_CRITICAL();
+
+	return ticks32 * (1000 / configTICK_RATE_HZ) * 1000 + (uint32_t)count * TIMEBASE_US_PER_COUNT;
+}
+
+uint32_t Timebase::Cycles()
+{
+	return Micros() * (configCPU_CLOCK_HZ / 1000000);
+}
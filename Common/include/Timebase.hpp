@@ -0,0 +1,38 @@
+/*
+ * Timebase.h
+ *
+ * Created: 17/10/2026 09.12.40
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdint.h>
+
+/* Timer 5 is owned by the FreeRTOS port (CTC, prescaler 64, one compare match per tick) */
+#define TIMEBASE_CYCLES_PER_COUNT	64
+#define TIMEBASE_US_PER_COUNT		4
+
+class Timebase
+{
+
+	public:
+		/**
+		*	Gets the time since the scheduler was started, built from the RTOS tick count and the tick timer.
+		*	Resolution is 4 us and the value wraps at 2^32 (~71 min), so the difference of two readings is right
+		*	across the wrap. A wrap of the 16-bit tick count is only seen if Micros is called at least every ~65 s.
+		*	@return Time in microseconds.
+		*/
+		static uint32_t Micros();
+
+		/**
+		*	Gets the number of CPU cycles since the scheduler was started (resolution 64 cycles).
+		*	Useful for measuring the cost of short operations by subtracting two readings, wraps at 2^32 (~4.5 min).
+		*	@return Time in CPU cycles.
+		*/
+		static uint32_t Cycles();
+};
+
+#endif /* TIMEBASE_H_ */
@@ -8,68 +8,168 @@
 
 #include "SPISerial.hpp"
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
+#include "task.h"
+
+#ifdef SPISERIAL_STATS
+#include "Timebase.hpp"
+#endif
+
 #define MOSI	PINB2
 #define MISO	PINB3
 #define SCK		PINB1
-#define SS		PINL7	// used to be PB4 changed to PL7
-#define SSOLD	PINB4
 
-SPISerial::SPISerial()
-{
-		
-		initSPI();			// Initialize SPI on AtMega2560
-		DeselectSlave();	// Deselect slave ie. set ss high
-		
-}
+const uint8_t* volatile SPIBus::txPtr_ = NULL;
+uint8_t* volatile SPIBus::rxPtr_ = NULL;
+volatile uint16_t SPIBus::remaining_ = 0;
+SlaveRelease SPIBus::release_ = NULL;
+void* SPIBus::releaseContext_ = NULL;
+xSemaphoreHandle SPIBus::doneSemaphore_ = NULL;
+bool SPIBus::initialized_ = false;
 
-uint8_t SPISerial::ReadByte()
-{	
-	// Send dummy byte and return data register
-	return WriteByte(0x00);
+#ifdef SPISERIAL_STATS
+SPIStats SPIBus::stats_ = {0, 0, 0, 0, 0};
+#endif
+
+#ifdef SPI_BUS_SHARED
+xSemaphoreHandle SPIBus::busMutex_ = NULL;
+#ifdef SPISERIAL_STATS
+uint32_t SPIBus::lockStart_ = 0;
+#endif
+#endif
+
+ISR(SPI_STC_vect)
+{
+	SPIBus::HandleInterrupt();
 }
 
-/* Very unsafe and vulnerable to overflow */
-uint16_t SPISerial::ReadBytes(uint8_t* bytes, uint16_t len)
+uint16_t SPIBus::Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len)
 {
-	for (int i = 0; i < len; i++)
-		bytes[i] = ReadByte();
+	uint16_t n = len;
+	
+	if (len == 0)
+		return 0;
+	
+	SPDR = (tx != NULL) ? *tx++ : 0x00;	// First byte goes on the wire
+	
+	/*
+	*	SPDR is single buffered for transmission but double buffered for reception, so once SPIF is set
+	*	the next byte is written first and the recieved one is read from the receive buffer while the next
+	*	is shifting. Each direction has its own loop to keep the NULL checks out of the 16 cycles a byte takes.
+	*/
+	if (tx != NULL && rx != NULL){
+		while (--n){
+			uint8_t next = *tx++;				// Fetched while the byte is on the wire
+			while(!(SPSR & (1<<SPIF)));
+			SPDR = next;
+			*rx++ = SPDR;
+		}
+	} else if (tx != NULL){
+		while (--n){
+			uint8_t next = *tx++;
+			while(!(SPSR & (1<<SPIF)));
+			SPDR = next;						// Accessing SPDR clears SPIF
+		}
+	} else if (rx != NULL){
+		while (--n){
+			while(!(SPSR & (1<<SPIF)));
+			SPDR = 0x00;
+			*rx++ = SPDR;
+		}
+	} else {
+		while (--n){
+			while(!(SPSR & (1<<SPIF)));
+			SPDR = 0x00;
+		}
+	}
+	
+	// Last byte
+	while(!(SPSR & (1<<SPIF)));
+	uint8_t last = SPDR;
+	if (rx != NULL)
+		*rx = last;
 	
 	return len;
 }
 
-uint8_t SPISerial::WriteByte(uint8_t byte)
+uint16_t SPIBus::Transaction(const uint8_t* tx, uint8_t* rx, uint16_t len, SlaveRelease release, void* context)
 {
+	if (len == 0)
+		return 0;
+	
+	/* Interrupt entry and exit costs more than clocking a few bytes at fosc/2 */
+	if (len < SPI_ASYNC_THRESHOLD || xTaskGetSchedulerState() != taskSCHEDULER_RUNNING){
+		Transfer(tx,rx,len);
+		
+		if (release != NULL)
+			release(context);
+		
+		return len;
+	}
 	
-	SPDR = byte;				// Load data register with byte
-	while(!(SPSR & (1<<SPIF)));	// Wait till transmission in completed
+#ifdef SPISERIAL_STATS
+	uint32_t start = Timebase::Cycles();
+#endif
 	
-	return SPDR;
+	txPtr_ = tx;
+	rxPtr_ = rx;
+	remaining_ = len;
+	release_ = release;
+	releaseContext_ = context;
+	
+	// Clock the first byte, the interrupt takes it from here
+	SPCR |= (1<<SPIE);
+	SPDR = (tx != NULL) ? *txPtr_++ : 0x00;
+	
+	/* Without vTaskSuspend portMAX_DELAY isn't infinite */
+	while (xSemaphoreTake(doneSemaphore_,portMAX_DELAY) != pdTRUE);
+	
+#ifdef SPISERIAL_STATS
+	stats_.cycles += Timebase::Cycles() - start;
+	stats_.transactions++;
+	stats_.bytes += len;
+#endif
+	
+	return len;
 }
 
-// If length is set to 0 we expect the bytes to be null-terminated
-uint16_t SPISerial::WriteBytes(uint8_t* bytes, uint16_t len)
+void SPIBus::HandleInterrupt()
 {
-	if (len == 0){
-		for (uint8_t* ch = bytes; *ch!='\0'; ch++)
-			WriteByte(*ch);
-	}
-	else if (len > 0){
-		for (int i = 0; i < len; i++)
-			WriteByte(bytes[i]);
+	uint8_t byte = SPDR;	// SPIF is cleared by entering the interrupt
+	
+	if (rxPtr_ != NULL)
+		*rxPtr_++ = byte;
+	
+	if (--remaining_ > 0){
+		SPDR = (txPtr_ != NULL) ? *txPtr_++ : 0x00;
+		return;
 	}
-	return len;
+	
+	// Transaction done, hand the bus back to polling
+	SPCR &= ~(1<<SPIE);
+	
+	if (release_ != NULL)
+		release_(releaseContext_);
+	
+	/* Switch to the waiting task right away instead of on the next tick (as the AVR demo serial ISR does) */
+	signed portBASE_TYPE woken = pdFALSE;
+	xSemaphoreGiveFromISR(doneSemaphore_,&woken);
+	
+	if (woken != pdFALSE)
+		taskYIELD();
 }
 
-void SPISerial::initSPI()
+void SPIBus::Initialize()
 {
-
-	// Initialize pins
-	DDRB = 0;
+	if (initialized_)
+		return;
+	initialized_ = true;
+	
+	// Initialize pins (slave selects are set up by their ChipSelect policy, other pins on the port are left alone)
 	DDRB &= ~(1<<MISO);											// Set MISO to input
-	DDRB |= ((1<<MOSI) | (1<<SCK) | (1<<PINB0));				// Set MOSI,SCK and SS to outputs
-	DDRL |= (1<<SS);
+	DDRB |= ((1<<MOSI) | (1<<SCK) | (1<<PINB0));				// Set MOSI,SCK and SS to outputs (PB0 keeps master mode)
 	
 	// Setup SPI Registers
 	SPCR |= (1<<SPE) | (1<<MSTR);			// Enable spi and set Master mode
@@ -79,24 +179,77 @@ void SPISerial::initSPI()
 	SPCR &= ~((1<<SPR0)|(1<<SPR1));			// fosc / 4	= 4MHz or fosc /2 = 8MHz with SPI2X
 	
 	
-	// Clear SPI Interrupt
-	uint8_t tmp = SPDR;
-	tmp = SPSR;
+	// Clear SPI Interrupt (SPIF is cleared by reading SPSR, then SPDR)
+	(void)SPSR;
+	(void)SPDR;
+	
+	vSemaphoreCreateBinary(doneSemaphore_);
+	xSemaphoreTake(doneSemaphore_,0);	// Binary semaphores are created given
+	
+#ifdef SPI_BUS_SHARED
+	busMutex_ = xSemaphoreCreateMutex();
+#endif
 	
 }
 
-void SPISerial::SelectSlave()
+SPISettings SPIBus::MakeSettings(uint8_t divider, uint8_t mode)
 {
-	PORTL &= ~(1<<SS);
+	SPISettings settings;
+	
+	settings.spcr = (1<<SPE) | (1<<MSTR) | mode;	// Enable spi and set Master mode
+	settings.spsr = 0;
+	
+	/* SPR1:0 select fosc/4 to fosc/128, SPI2X doubles it */
+	switch (divider){
+		case 2:		settings.spsr = (1<<SPI2X);									break;
+		case 4:																	break;
+		case 8:		settings.spsr = (1<<SPI2X); settings.spcr |= (1<<SPR0);	break;
+		case 16:	settings.spcr |= (1<<SPR0);									break;
+		case 32:	settings.spsr = (1<<SPI2X); settings.spcr |= (1<<SPR1);	break;
+		case 64:	settings.spcr |= (1<<SPR1);									break;
+		default:	settings.spcr |= (1<<SPR1) | (1<<SPR0);						break;
+	}
+	
+	return settings;
 }
 
-void SPISerial::DeselectSlave()
+#ifdef SPI_BUS_SHARED
+void SPIBus::Lock(const SPISettings& settings)
 {
-	PORTL |= (1<<SS);
+	/* Before the scheduler runs there is only one task. Without vTaskSuspend portMAX_DELAY isn't infinite */
+	if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+		while (xSemaphoreTake(busMutex_,portMAX_DELAY) != pdTRUE);
+	
+	Apply(settings);	// the previous holder may have used other settings
+	
+#ifdef SPISERIAL_STATS
+	lockStart_ = Timebase::Micros();
+#endif
 }
 
-SPISerial::~SPISerial()
+void SPIBus::Unlock()
 {
+#ifdef SPISERIAL_STATS
+	uint32_t held = Timebase::Micros() - lockStart_;
+	if (held > stats_.maxHoldUs)
+		stats_.maxHoldUs = held;
+	if (held > SPI_BUS_MAX_HOLD_US)
+		stats_.overruns++;
+#endif
 	
+	/* Same condition as Lock, a shared flag would be cleared by the previous holder while the next one waits */
+	if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+		xSemaphoreGive(busMutex_);
+}
+
+void SPIBus::Yield(const SPISettings& settings)
+{
+	Unlock();
 	
-}
\ No newline at end of file
+	/* Giving the mutex doesn't switch tasks at equal priority, so a waiting slave only gets the bus if we yield */
+	if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+		taskYIELD();
+	
+	Lock(settings);
+}
+#endif
@@ -0,0 +1,66 @@
+/*
+ * USARTSPISerial.cpp
+ *
+ * Created: 17/10/2026 14.06.40
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */ 
+#include "USARTSPISerial.hpp"
+#include <avr/io.h>
+#include <stddef.h>
+
+#define XCK		PINJ2
+#define TXD		PINJ1
+#define RXD		PINJ0
+
+bool USARTBus::initialized_ = false;
+
+uint16_t USARTBus::Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len)
+{
+	uint16_t sent = 0;
+	uint16_t recieved = 0;
+	
+	/*
+	*	The transmitter takes a new byte while the previous one is shifting, so it never idles.
+	*	Every sent byte clocks one in, which has to be read before a third one arrives.
+	*/
+	while (recieved < len){
+		if (sent < len && (uint16_t)(sent - recieved) < 2 && (UCSR3A & (1<<UDRE3))){
+			UDR3 = (tx != NULL) ? tx[sent] : 0x00;
+			sent++;
+		}
+		
+		if (UCSR3A & (1<<RXC3)){
+			uint8_t byte = UDR3;
+			if (rx != NULL)
+				rx[recieved] = byte;
+			recieved++;
+		}
+	}
+	
+	return len;
+}
+
+void USARTBus::Initialize()
+{
+	if (initialized_)
+		return;
+	initialized_ = true;
+	
+	UBRR3 = 0;
+	
+	// Initialize pins, XCK as output selects master mode
+	DDRJ |= (1<<XCK) | (1<<TXD);
+	DDRJ &= ~(1<<RXD);
+	
+	// Master SPI mode, SPI mode 0 (UCPHA3 = 0), MSB first (UDORD3 = 0)
+	UCSR3C = (1<<UMSEL31) | (1<<UMSEL30);
+	UCSR3B = (1<<RXEN3) | (1<<TXEN3);
+	
+	// Baud rate has to be set after the transmitter is enabled, fosc / (2 * (UBRR + 1)) = 8MHz
+	UBRR3 = 0;
+	
+	// Flush the receive buffer
+	while (UCSR3A & (1<<RXC3)){
+		(void)UDR3;
+	}
+}
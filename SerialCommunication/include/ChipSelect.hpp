@@ -0,0 +1,41 @@
+/*
+ * ChipSelect.hpp
+ *
+ * Created: 17/10/2026 15.21.07
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */ 
+
+
+#ifndef CHIPSELECT_H_
+#define CHIPSELECT_H_
+
+#include <avr/io.h>
+
+/*
+*	Chip-select policy for the serial transports (the slave is active low). A policy has Initialize, Select and
+*	Deselect, the transports are templates over it so the calls inline instead of going through ISerial.
+*
+*	The pin is given at construction, so several slaves of the same kind share one transport type.
+*	Selecting costs a pointer load more than a fixed port would, which is small next to a byte on the wire.
+*	The data direction register is found at PORTx - 1 (PINx, DDRx and PORTx are consecutive on the AVR).
+*/
+class PinChipSelect
+{
+	
+	public:
+		/**
+		*	@param port		Port register of the pin (for example &PORTL).
+		*	@param pin		Pin number within the port.
+		*/
+		PinChipSelect(volatile uint8_t* port, uint8_t pin) : port_(port), mask_(1<<pin) {};
+		
+		inline void Initialize()	{*(port_ - 1) |= mask_;};
+		inline void Select()		{*port_ &= ~mask_;};
+		inline void Deselect()		{*port_ |= mask_;};
+		
+	private:
+		volatile uint8_t* port_;
+		uint8_t mask_;
+};
+
+#endif /* CHIPSELECT_H_ */
@@ -10,15 +10,68 @@
 #define ISERIAL_H_
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* One chip-select window of a batched job: a command byte followed by a payload */
+typedef struct SerialSegment {
+	uint8_t command;		// First byte clocked in the window
+	const uint8_t* tx;		// Payload to transmit, NULL transmits dummy bytes
+	uint8_t* rx;			// Buffer for the recieved payload, NULL discards it
+	uint16_t len;			// Payload length
+	uint8_t status;			// Set to the byte recieved while the command was clocked
+} SerialSegment;
 
 class ISerial
 {
 	
 	public:
+		virtual ~ISerial() {};
+		
 		virtual uint8_t ReadByte() = 0;
 		virtual uint8_t WriteByte(uint8_t byte) = 0;
 		virtual uint16_t ReadBytes(uint8_t* bytes, uint16_t len) = 0;
 		virtual uint16_t WriteBytes(uint8_t* bytes, uint16_t len) = 0;
+		
+		/**
+		*	Transmits and recieves len bytes at the same time (full-duplex).
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to transfer.
+		*	@return Number of bytes transferred.
+		*/
+		virtual uint16_t Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len) = 0;
+		
+		/**
+		*	Selects the slave (chip select low)
+		*/
+		virtual void SelectSlave() = 0;
+		
+		/**
+		*	Deselects the slave (chip select high)
+		*/
+		virtual void DeselectSlave() = 0;
+		
+		/**
+		*	Changes the serial clock to fosc / divider.
+		*	@param divider	Clock divider (2, 4, 8, 16, 32, 64 or 128).
+		*/
+		virtual void SetClockDivider(uint8_t divider) = 0;
+		
+		/**
+		*	Executes a list of segments in one call, each in its own chip-select window.
+		*	Backends override this to clock the whole job without a virtual call per step.
+		*	@param segments		Segments to execute in order.
+		*	@param count		Number of segments.
+		*/
+		virtual void Execute(SerialSegment* segments, uint8_t count)
+		{
+			for (uint8_t i = 0; i < count; i++){
+				SelectSlave();
+				segments[i].status = WriteByte(segments[i].command);
+				Transfer(segments[i].tx,segments[i].rx,segments[i].len);
+				DeselectSlave();
+			}
+		};
 };
 
 
@@ -9,12 +9,226 @@
 #ifndef SPISerial_H_
 #define SPISerial_H_
 
+#include <avr/io.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#define SPI_ASYNC_THRESHOLD	8	// Transactions shorter than this are polled, the interrupt overhead isn't worth it
+#define SPI_ASYNC_DIVIDER	32	// Slowest clocks only: at fosc/32 a byte is 256 cycles, so the interrupt frees most of them
+
+/* SPI modes (clock polarity and phase) */
+#define SPI_MODE0	0
+#define SPI_MODE1	(1<<CPHA)
+#define SPI_MODE2	(1<<CPOL)
+#define SPI_MODE3	((1<<CPOL) | (1<<CPHA))
+
+/*
+*	With SPI_BUS_SHARED defined, slaves lock the bus with a mutex for each job and the bus is reconfigured for the
+*	slave that holds it. A job that would hold the bus longer than SPI_BUS_MAX_HOLD_US hands it over between
+*	chip-select windows, so a waiting slave gets it within about that time. A single window isn't split, a 64 byte
+*	FIFO takes ~70 us at 8MHz. All tasks run at one priority (configMAX_PRIORITIES), so the hand-over yields rather
+*	than relying on priority inheritance. Without SPI_BUS_SHARED the bus has a single slave and locking compiles away.
+*/
+#define SPI_BUS_MAX_HOLD_US	100
+#define SPI_BUS_MAX_HOLD_BYTES(divider)	(SPI_BUS_MAX_HOLD_US * (configCPU_CLOCK_HZ / 1000000) / 8 / (divider))
+
+/* SPCR and SPSR of a slave */
+typedef struct SPISettings {
+	uint8_t spcr;
+	uint8_t spsr;
+} SPISettings;
+
+/**
+*	Called from the SPI interrupt when the last byte of a transaction has been clocked.
+*	@param context		Context given with the transaction.
+*/
+typedef void (*SlaveRelease)(void* context);
+
+#ifdef SPISERIAL_STATS
+/* Timings are Timebase readings (4 us resolution) and haven't been validated on the hardware yet */
+typedef struct SPIStats {
+	uint32_t transactions;	// Interrupt-driven transactions
+	uint32_t bytes;			// Bytes clocked by the interrupt
+	uint32_t cycles;		// CPU cycles from the first byte until the task woke up again
+	uint32_t maxHoldUs;		// Longest time a slave has held the bus (SPI_BUS_SHARED)
+	uint32_t overruns;		// Times a slave held the bus longer than SPI_BUS_MAX_HOLD_US (SPI_BUS_SHARED)
+} SPIStats;
+#endif
+
+/*
+*	The SPI peripheral, shared by every slave on the bus. Slaves are selected by SPISerial.
+*/
+class SPIBus
+{
+	
+	public:
+		/**
+		*	Initializes the SPI with defined MOSI,MISO,SS and SCK (only the first call does anything).
+		*/
+		static void Initialize();
+		
+		/**
+		*	Builds the SPCR and SPSR settings of a slave.
+		*	@param divider	Clock divider (2, 4, 8, 16, 32, 64 or 128).
+		*	@param mode		SPI_MODE0 to SPI_MODE3.
+		*	@return Settings to pass to Acquire.
+		*/
+		static SPISettings MakeSettings(uint8_t divider, uint8_t mode);
+		
+		/**
+		*	Writes settings to SPCR and SPSR, unless the bus already runs with them.
+		*	@param settings		Settings to apply.
+		*/
+		static inline void Apply(const SPISettings& settings)
+		{
+			if (SPCR != settings.spcr)
+				SPCR = settings.spcr;
+			if ((SPSR & (1<<SPI2X)) != settings.spsr)
+				SPSR = settings.spsr;
+		};
+		
+		/**
+		*	Waits for the bus and configures it for a slave.
+		*	The settings are applied even without SPI_BUS_SHARED, every chip keeps the clock it was calibrated to.
+		*	@param settings		Settings of the slave.
+		*/
+		static inline void Acquire(const SPISettings& settings)
+		{
+#ifdef SPI_BUS_SHARED
+			Lock(settings);
+#else
+			Apply(settings);
+#endif
+		};
+		
+		/**
+		*	Hands the bus to the next waiting slave.
+		*/
+		static inline void Release()
+		{
+#ifdef SPI_BUS_SHARED
+			Unlock();
+#endif
+		};
+		
+#ifdef SPI_BUS_SHARED
+		/**
+		*	Lets a waiting slave have the bus and takes it back, used between the chip-select windows of a long job.
+		*	@param settings		Settings of the slave.
+		*/
+		static void Yield(const SPISettings& settings);
+#endif
+		
+		/**
+		*	Transmits a byte and returns the byte recieved meanwhile.
+		*	@param byte		Byte to transmit.
+		*	@return Byte leftover in the data register after transmission.
+		*/
+		static inline uint8_t Exchange(uint8_t byte)
+		{
+			SPDR = byte;				// Load data register with byte
+			while(!(SPSR & (1<<SPIF)));	// Wait till transmission in completed
+			return SPDR;
+		};
+		
+		/**
+		*	Transmits and recieves len bytes at the same time (full-duplex). The next byte is written to SPDR
+		*	as soon as SPIF is set and the recieved byte is read from the receive buffer afterwards,
+		*	so bytes are clocked back to back.
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to transfer.
+		*	@return Number of bytes transferred.
+		*/
+		static uint16_t Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len);
+		
+		/**
+		*	Clocks a buffer through the SPI. The SPI interrupt streams the bytes while the calling task
+		*	sleeps, so other tasks get the CPU during long transfers. Short transactions, and transactions
+		*	issued before the scheduler runs, are polled instead.
+		*	The slave has to be selected by the caller, which allows a command byte to be clocked first.
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to clock.
+		*	@param release	Called from the interrupt after the last byte (typically deselects the slave), may be NULL.
+		*	@param context	Context passed to release.
+		*	@return Number of bytes clocked.
+		*/
+		static uint16_t Transaction(const uint8_t* tx, uint8_t* rx, uint16_t len, SlaveRelease release, void* context);
+		
+		/**
+		*	Called from the SPI transfer complete interrupt. Clocks the next byte of the running transaction.
+		*/
+		static void HandleInterrupt();
+		
+#ifdef SPISERIAL_STATS
+		/**
+		*	Gets the counters of the interrupt-driven transactions, cycles/bytes is the cost per byte.
+		*	@return Transaction counters.
+		*/
+		static const SPIStats& GetStats() {return stats_;};
+#endif
+
+	private:
+#ifdef SPI_BUS_SHARED
+		/**
+		*	Takes the bus mutex (once the scheduler runs) and applies the slave's settings.
+		*	@param settings		Settings of the slave.
+		*/
+		static void Lock(const SPISettings& settings);
+		
+		/**
+		*	Gives the bus mutex back (once the scheduler runs, Lock and Unlock are always paired within one call).
+		*/
+		static void Unlock();
+		
+		static xSemaphoreHandle busMutex_;
+#ifdef SPISERIAL_STATS
+		static uint32_t lockStart_;			// Time the bus was taken
+#endif
+#endif
+		
+		/* Running transaction, advanced by the SPI interrupt */
+		static const uint8_t* volatile txPtr_;
+		static uint8_t* volatile rxPtr_;
+		static volatile uint16_t remaining_;
+		static SlaveRelease release_;
+		static void* releaseContext_;
+		static xSemaphoreHandle doneSemaphore_;	// Given by the interrupt when the transaction is done
+		
+		static bool initialized_;
+		
+#ifdef SPISERIAL_STATS
+		static SPIStats stats_;
+#endif
+};
+
+/*
+*	A slave on the SPI bus. The chip select is a policy (see ChipSelect.hpp), so calls on an
+*	SPISerial object inline to the register accesses instead of going through ISerial.
+*/
+template <class CS>
 class SPISerial : public ISerial 
 {
 	
 	public:
-		SPISerial();
-		virtual ~SPISerial();
+		/**
+		*	@param cs		Chip select of the slave.
+		*	@param divider	SPI clock divider of the slave (2, 4, 8, 16, 32, 64 or 128).
+		*	@param mode		SPI mode of the slave (SPI_MODE0 to SPI_MODE3).
+		*/
+		SPISerial(const CS& cs = CS(), uint8_t divider = 2, uint8_t mode = SPI_MODE0) : cs_(cs)
+		{
+			SPIBus::Initialize();	// Initialize SPI on AtMega2560
+			mode_ = mode;
+			divider_ = divider;
+			settings_ = SPIBus::MakeSettings(divider,mode);
+			cs_.Initialize();
+			cs_.Deselect();			// Deselect slave ie. set ss high
+		};
+		
+		virtual ~SPISerial() {};
 		
 		// Public methods
 		
@@ -23,14 +237,14 @@ class SPISerial : public ISerial
 			dummy byte and returning the leftover data.
 		*	@return The read byte.
 		*/
-		uint8_t ReadByte();
+		uint8_t ReadByte() {return SPIBus::Exchange(0x00);};
 		
 		/**
 		*	Transmits a specified byte to the SPI.
 		*	@param byte		Specified byte to write over SPI.
 		*	@return Byte leftover in the data register after transmission.
 		*/
-		uint8_t WriteByte(uint8_t byte);
+		uint8_t WriteByte(uint8_t byte) {return SPIBus::Exchange(byte);};
 		
 		/**
 		*	Reads a specified length of bytes into a byte array passed as argument.
@@ -38,37 +252,105 @@ class SPISerial : public ISerial
 		*	@param len		Number of bytes to read.
 		*	@return Length of read data.
 		*/
-		uint16_t ReadBytes(uint8_t* bytes, uint16_t len);
+		uint16_t ReadBytes(uint8_t* bytes, uint16_t len) {return SPIBus::Transfer(NULL,bytes,len);};
 		
 		/**
 		*	Transmits specified bytes to SPI.
+		*	If length is set to 0 we expect the bytes to be null-terminated.
 		*	@param bytes	Specified bytes to transmit.
 		*	@param len		Number of bytes to transmit.
 		*	@return Length of transmitted bytes.
 		*/
-		uint16_t WriteBytes(uint8_t* bytes, uint16_t len);
+		uint16_t WriteBytes(uint8_t* bytes, uint16_t len)
+		{
+			if (len == 0){
+				for (uint8_t* ch = bytes; *ch!='\0'; ch++)
+					SPIBus::Exchange(*ch);
+				return 0;
+			}
+			return SPIBus::Transfer(bytes,NULL,len);
+		};
 		
 		/**
-		*	Selects slave on pin SS (by setting SS low)
+		*	Transmits and recieves len bytes at the same time (full-duplex), see SPIBus::Transfer.
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to transfer.
+		*	@return Number of bytes transferred.
 		*/
-		void SelectSlave();
+		uint16_t Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len) {return SPIBus::Transfer(tx,rx,len);};
 		
 		/**
-		*	Deselects slave on pin SS (by setting SS high)
+		*	Executes a list of segments in one pass, each in its own chip-select window. When the slave is
+		*	clocked at SPI_ASYNC_DIVIDER or slower, long segments go through the SPI interrupt while the task sleeps.
+		*	On a shared bus the job hands the bus over between windows once it has held it for SPI_BUS_MAX_HOLD_US.
+		*	@param segments		Segments to execute in order.
+		*	@param count		Number of segments.
 		*/
-		void DeselectSlave();
-
-	private:
-		// Private methods
+		void Execute(SerialSegment* segments, uint8_t count)
+		{
+			bool async = divider_ >= SPI_ASYNC_DIVIDER;
+#ifdef SPI_BUS_SHARED
+			uint16_t held = 0;	// Bytes clocked since the bus was taken
+#endif
+			
+			SPIBus::Acquire(settings_);
+			for (uint8_t i = 0; i < count; i++){
+#ifdef SPI_BUS_SHARED
+				uint16_t bytes = segments[i].len + 1;
+				if (held > 0 && held + bytes > SPI_BUS_MAX_HOLD_BYTES(divider_)){
+					SPIBus::Yield(settings_);
+					held = 0;
+				}
+				held += bytes;
+#endif
+				cs_.Select();
+				segments[i].status = SPIBus::Exchange(segments[i].command);
+				if (async)
+					SPIBus::Transaction(segments[i].tx,segments[i].rx,segments[i].len,NULL,NULL);	// polls short segments itself
+				else
+					SPIBus::Transfer(segments[i].tx,segments[i].rx,segments[i].len);
+				cs_.Deselect();
+			}
+			SPIBus::Release();
+		};
+		
+		/**
+		*	Changes the SPI clock of this slave to fosc / divider.
+		*	@param divider	Clock divider (2, 4, 8, 16, 32, 64 or 128).
+		*/
+		void SetClockDivider(uint8_t divider)
+		{
+			divider_ = divider;
+			settings_ = SPIBus::MakeSettings(divider,mode_);
+			SPIBus::Acquire(settings_);		// applies the new settings
+			SPIBus::Release();
+		};
+		
 		/**
-		* Initializes the SPI with defined MOSI,MISO,SS and SCK
+		*	Acquires the bus and selects slave on pin SS (by setting SS low)
 		*/
-		void initSPI();
+		void SelectSlave()
+		{
+			SPIBus::Acquire(settings_);
+			cs_.Select();
+		};
 		
-		// Private attributes
-		uint8_t _rxBuffer[16];
-		uint8_t _txBuffer[16];
+		/**
+		*	Deselects slave on pin SS (by setting SS high) and releases the bus
+		*/
+		void DeselectSlave()
+		{
+			cs_.Deselect();
+			SPIBus::Release();
+		};
+		
+	private:
+		CS cs_;
+		SPISettings settings_;	// Clock and mode of this slave
+		uint8_t mode_;
+		uint8_t divider_;
 		
 };
 
-#endif /* SPISerial_H_ */
\ No newline at end of file
+#endif /* SPISerial_H_ */
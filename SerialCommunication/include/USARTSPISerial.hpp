@@ -0,0 +1,161 @@
+/*
+ * USARTSPISerial.hpp
+ *
+ * Created: 17/10/2026 14.05.12
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */ 
+#include "ISerial.hpp"
+
+#ifndef USARTSPISerial_H_
+#define USARTSPISerial_H_
+
+#include <avr/io.h>
+
+/*
+*	USART3 in Master SPI Mode (MSPIM). MOSI is TXD3 (PJ1), MISO is RXD3 (PJ0) and SCK is XCK3 (PJ2),
+*	so slaves have to be wired to these pins instead of the SPI pins.
+*	UDR3 is double buffered for transmission, which lets the next byte be queued while the current one
+*	is shifting and keeps the clock running continuously.
+*/
+class USARTBus
+{
+	
+	public:
+		/**
+		*	Initializes USART3 as SPI master (mode 0, MSB first, fosc/2), only the first call does anything.
+		*/
+		static void Initialize();
+		
+		/**
+		*	Transmits a byte and waits for the byte clocked in at the same time.
+		*	@param byte		Byte to transmit.
+		*	@return Byte recieved during transmission.
+		*/
+		static inline uint8_t Exchange(uint8_t byte)
+		{
+			while(!(UCSR3A & (1<<UDRE3)));	// Wait for the transmit buffer
+			UDR3 = byte;
+			while(!(UCSR3A & (1<<RXC3)));	// Wait for the byte clocked in meanwhile
+			return UDR3;
+		};
+		
+		/**
+		*	Transmits and recieves len bytes at the same time (full-duplex). Up to two bytes are queued
+		*	ahead of the recieved ones, which is as many as the receive buffer can hold.
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to transfer.
+		*	@return Number of bytes transferred.
+		*/
+		static uint16_t Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len);
+		
+	private:
+		static bool initialized_;
+};
+
+/*
+*	A slave on USART3 in master SPI mode. The chip select is a policy (see ChipSelect.hpp).
+*/
+template <class CS>
+class USARTSPISerial : public ISerial
+{
+	
+	public:
+		/**
+		*	@param cs		Chip select of the slave.
+		*/
+		USARTSPISerial(const CS& cs = CS()) : cs_(cs)
+		{
+			USARTBus::Initialize();		// Initialize USART3 in master SPI mode
+			cs_.Initialize();
+			cs_.Deselect();				// Deselect slave ie. set ss high
+		};
+		
+		virtual ~USARTSPISerial() {};
+		
+		// Public methods
+		
+		/**
+		*	Reads a byte by transmitting a dummy byte.
+		*	@return The read byte.
+		*/
+		uint8_t ReadByte() {return USARTBus::Exchange(0x00);};
+		
+		/**
+		*	Transmits a specified byte and waits for the byte clocked in at the same time.
+		*	@param byte		Specified byte to write.
+		*	@return Byte recieved during transmission.
+		*/
+		uint8_t WriteByte(uint8_t byte) {return USARTBus::Exchange(byte);};
+		
+		/**
+		*	Reads a specified length of bytes into a byte array passed as argument.
+		*	@param bytes	Specified byte buffer to fill read data into.
+		*	@param len		Number of bytes to read.
+		*	@return Length of read data.
+		*/
+		uint16_t ReadBytes(uint8_t* bytes, uint16_t len) {return USARTBus::Transfer(NULL,bytes,len);};
+		
+		/**
+		*	Transmits specified bytes.
+		*	If length is set to 0 we expect the bytes to be null-terminated.
+		*	@param bytes	Specified bytes to transmit.
+		*	@param len		Number of bytes to transmit.
+		*	@return Length of transmitted bytes.
+		*/
+		uint16_t WriteBytes(uint8_t* bytes, uint16_t len)
+		{
+			if (len == 0){
+				for (uint8_t* ch = bytes; *ch!='\0'; ch++)
+					USARTBus::Exchange(*ch);
+				return 0;
+			}
+			return USARTBus::Transfer(bytes,NULL,len);
+		};
+		
+		/**
+		*	Transmits and recieves len bytes at the same time (full-duplex), see USARTBus::Transfer.
+		*	@param tx		Bytes to transmit, NULL transmits dummy bytes.
+		*	@param rx		Buffer for the recieved bytes, NULL discards them.
+		*	@param len		Number of bytes to transfer.
+		*	@return Number of bytes transferred.
+		*/
+		uint16_t Transfer(const uint8_t* tx, uint8_t* rx, uint16_t len) {return USARTBus::Transfer(tx,rx,len);};
+		
+		/**
+		*	Executes a list of segments in one pass, each in its own chip-select window.
+		*	@param segments		Segments to execute in order.
+		*	@param count		Number of segments.
+		*/
+		void Execute(SerialSegment* segments, uint8_t count)
+		{
+			for (uint8_t i = 0; i < count; i++){
+				cs_.Select();
+				segments[i].status = USARTBus::Exchange(segments[i].command);
+				USARTBus::Transfer(segments[i].tx,segments[i].rx,segments[i].len);
+				cs_.Deselect();		// The last bit has been recieved, so it's also out of the shift register
+			}
+		};
+		
+		/**
+		*	Changes the clock to fosc / divider (fosc / (2 * (UBRR3 + 1))).
+		*	@param divider	Clock divider (2, 4, 8, 16, 32, 64 or 128).
+		*/
+		void SetClockDivider(uint8_t divider) {UBRR3 = (divider >> 1) - 1;};
+		
+		/**
+		*	Selects slave (by setting its chip select low)
+		*/
+		void SelectSlave() {cs_.Select();};
+		
+		/**
+		*	Deselects slave (by setting its chip select high)
+		*/
+		void DeselectSlave() {cs_.Deselect();};
+		
+	private:
+		CS cs_;
+		
+};
+
+#endif /* USARTSPISerial_H_ */
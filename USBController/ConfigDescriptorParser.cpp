@@ -0,0 +1,164 @@
+/*
+ * ConfigDescriptorParser.cpp
+ *
+ * Created: 17/10/2026 16.09.12
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+#include "ConfigDescriptorParser.hpp"
+#include <stddef.h>
+#include "Logger.hpp"
+
+ConfigDescriptorParser::ConfigDescriptorParser()
+{
+	Reset();
+}
+
+uint8_t ConfigDescriptorParser::Read(MAX3421E* max, uint8_t addr)
+{
+	USB_CONFIGURATION_DESCRIPTOR header;
+	uint8_t rcode;
+
+	Reset();
+
+	/* Header first, it holds the length of the whole set */
+	rcode = max->GetConfigDescriptor(addr,0,sizeof(header),(uint8_t*)&header);
+	if (rcode != hrSUCCES)
+		return rcode;
+
+	if (header.wTotalLength < sizeof(header))
+		return hrDATAERROR;
+
+	rcode = max->GetConfigDescriptorStream(addr,0,header.wTotalLength,Consume,this);
+	if (rcode != hrSUCCES)
+		return rcode;
+
+	if (!IsComplete()){
+		LOG_ERROR("Malformed configuration descriptor.");
+		return hrDATAERROR;
+	}
+
+	return hrSUCCES;
+}
+
+void ConfigDescriptorParser::Reset()
+{
+	length_			= 0;
+	offset_			= 0;
+	received_		= 0;
+	totalLength_	= 0;
+	malformed_		= false;
+	configValue_	= 0;
+	numInterfaces_	= 0;
+	current_		= NULL;
+}
+
+void ConfigDescriptorParser::Consume(uint8_t* packet, uint8_t len, void* context)
+{
+	static_cast<ConfigDescriptorParser*>(context)->Parse(packet,len);
+}
+
+void ConfigDescriptorParser::Parse(const uint8_t* data, uint8_t len)
+{
+	for (uint8_t i = 0; i < len && !malformed_; i++){
+
+		// Ignore whatever follows the set
+		if (totalLength_ != 0 && received_ >= totalLength_)
+			return;
+
+		received_++;
+
+		if (offset_ == 0){
+			length_ = data[i];
+
+			// bLength covers bLength and bDescriptorType at least, anything shorter would never end
+			if (length_ < 2){
+				malformed_ = true;
+				return;
+			}
+		}
+
+		if (offset_ < sizeof(buffer_))
+			buffer_[offset_] = data[i];
+
+		if (++offset_ == length_){
+			ParseDescriptor();
+			offset_ = 0;
+		}
+	}
+}
+
+void ConfigDescriptorParser::ParseDescriptor()
+{
+	uint8_t used = (length_ < sizeof(buffer_)) ? length_ : sizeof(buffer_);
+
+	switch (buffer_[1]){
+		case USB_DESCRIPTOR_CONFIGURATION:
+			if (used < sizeof(USB_CONFIGURATION_DESCRIPTOR) || received_ != length_){
+				malformed_ = true;	// has to come first
+				break;
+			}
+			totalLength_	= buffer_[2] | (buffer_[3] << 8);
+			configValue_	= buffer_[5];
+			break;
+
+		case USB_DESCRIPTOR_INTERFACE:
+			current_ = NULL;
+
+			// Alternate settings aren't used, their endpoints are skipped
+			if (used < sizeof(USB_INTERFACE_DESCRIPTOR) || buffer_[3] != 0 || numInterfaces_ >= CONFIG_PARSER_INTERFACES)
+				break;
+
+			current_ = &interfaces_[numInterfaces_++];
+			current_->bInterfaceNumber		= buffer_[2];
+			current_->bInterfaceClass		= buffer_[5];
+			current_->bInterfaceSubClass	= buffer_[6];
+			current_->bInterfaceProtocol	= buffer_[7];
+			current_->numEndpoints			= 0;
+			break;
+
+		case USB_DESCRIPTOR_ENDPOINT:
+			if (current_ == NULL || used < 7 || current_->numEndpoints >= CONFIG_PARSER_ENDPOINTS)
+				break;
+			{
+				ParsedEndpoint* ep = &current_->endpoints[current_->numEndpoints++];
+				ep->bEndpointAddress	= buffer_[2];
+				ep->bmAttributes		= buffer_[3];
+				ep->maxPktSize			= buffer_[4];
+				ep->bInterval			= buffer_[6];
+			}
+			break;
+
+		default:
+			// Class and vendor descriptors (HID and such) are skipped
+			break;
+	}
+}
+
+const ParsedInterface* ConfigDescriptorParser::FindInterface(uint8_t interfaceClass, uint8_t subClass, uint8_t protocol) const
+{
+	for (uint8_t i = 0; i < numInterfaces_; i++){
+		const ParsedInterface* interface = &interfaces_[i];
+
+		if (interface->bInterfaceClass == interfaceClass && interface->bInterfaceSubClass == subClass
+			&& interface->bInterfaceProtocol == protocol)
+			return interface;
+	}
+
+	return NULL;
+}
+
+const ParsedEndpoint* ConfigDescriptorParser::FindEndpoint(const ParsedInterface* interface, bool in, uint8_t type)
+{
+	if (interface == NULL)
+		return NULL;
+
+	for (uint8_t i = 0; i < interface->numEndpoints; i++){
+		const ParsedEndpoint* ep = &interface->endpoints[i];
+
+		if (((ep->bEndpointAddress & 0x80) != 0) == in && (ep->bmAttributes & 0x03) == type)
+			return ep;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * DescriptorCache.cpp
+ *
+ * Created: 17/10/2026 15.24.51
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+#include "DescriptorCache.hpp"
+#include <avr/eeprom.h>
+#include <stddef.h>
+
+static CachedConfig cacheSlots_[DESCRIPTOR_CACHE_SLOTS] EEMEM;
+static uint8_t cacheNext_ EEMEM;	// Slot replaced next when the cache is full
+
+bool DescriptorCache::Find(uint16_t vid, uint16_t pid, uint16_t bcdDevice, CachedConfig* config)
+{
+	return FindSlot(vid,pid,bcdDevice,config) >= 0;
+}
+
+void DescriptorCache::Store(CachedConfig* config)
+{
+	CachedConfig entry;
+	int8_t slot = FindSlot(config->idVendor,config->idProduct,config->bcdDevice,&entry);
+
+	/* New device, take a free slot or the oldest one */
+	if (slot < 0){
+		for (uint8_t i = 0; i < DESCRIPTOR_CACHE_SLOTS && slot < 0; i++){
+			eeprom_read_block(&entry,&cacheSlots_[i],sizeof(entry));
+			if (entry.checksum != Checksum(&entry))
+				slot = i;
+		}
+	}
+
+	if (slot < 0){
+		slot = eeprom_read_byte(&cacheNext_) % DESCRIPTOR_CACHE_SLOTS;
+		eeprom_update_byte(&cacheNext_,(slot + 1) % DESCRIPTOR_CACHE_SLOTS);
+	}
+
+	if (config->numEndpoints > DESCRIPTOR_CACHE_ENDPOINTS)
+		config->numEndpoints = DESCRIPTOR_CACHE_ENDPOINTS;
+
+	config->checksum = Checksum(config);
+	eeprom_update_block(config,&cacheSlots_[slot],sizeof(CachedConfig));
+}
+
+void DescriptorCache::Invalidate(uint16_t vid, uint16_t pid, uint16_t bcdDevice)
+{
+	CachedConfig entry;
+	int8_t slot = FindSlot(vid,pid,bcdDevice,&entry);
+
+	if (slot >= 0)
+		eeprom_update_byte(&cacheSlots_[slot].checksum,~entry.checksum);
+}
+
+int8_t DescriptorCache::FindSlot(uint16_t vid, uint16_t pid, uint16_t bcdDevice, CachedConfig* config)
+{
+	for (uint8_t i = 0; i < DESCRIPTOR_CACHE_SLOTS; i++){
+		eeprom_read_block(config,&cacheSlots_[i],sizeof(CachedConfig));
+
+		if (config->checksum != Checksum(config))
+			continue;	// erased or invalidated
+
+		if (config->idVendor == vid && config->idProduct == pid && config->bcdDevice == bcdDevice)
+			return i;
+	}
+
+	return -1;
+}
+
+uint8_t DescriptorCache::Checksum(const CachedConfig* config)
+{
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(config);
+	uint8_t sum = 0x5A;		// an erased slot (all 0xFF) doesn't sum up to its checksum byte
+
+	for (uint8_t i = 0; i < offsetof(CachedConfig,checksum); i++)
+		sum += bytes[i];
+
+	return sum;
+}
@@ -8,24 +8,102 @@
 #define F_CPU 16000000
 
 #include <util/delay.h>
+#include <avr/interrupt.h>
 #include "MAX3421E.hpp"
 #include <string.h>
 #include "max3421defs.h"
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "Logger.hpp"
 #include "FreeRTOS.h"
 #include "task.h"
+#include "Timebase.hpp"
+
+#define SCRIPT_LENGTH(script)	(sizeof(script)/sizeof(script[0]))
+
+/* Register scripts, run by RunScript */
+static const RegisterOp chipResetScript[] PROGMEM = {
+	{USBCTL,	(1<<CHIPRES),								REG_MASK_ALL},	// Chip reset
+	{USBCTL,	0x00,										REG_MASK_ALL},	// Clear register (chip reset and powerdown)
+};
+
+static const RegisterOp hostModeScript[] PROGMEM = {
+	{MODE,		(1<<DPPULLDN) | (1<<DMPULLDN) | (1<<HOST),	REG_MASK_ALL},	// Pull d+ and d- low and set host mode
+	{HIEN,		(1<<HXFRDNIE) | (1<<CONDETIE),				REG_MASK_ALL},	// Assert INT when a transfer is done or a device (dis)connects, so the task can sleep instead of polling HIRQ (starts disconnected)
+	{CPUCTL,	(1<<IE),									REG_MASK_ALL},
+};
+
+/* CONDETIE only while waiting for a connect, so bus events don't wake transfer waits. CONDETIRQ is still latched in HIRQ */
+static const RegisterOp connectWaitScript[] PROGMEM = {
+	{HIEN,		(1<<CONDETIE),								(1<<CONDETIE)},
+};
+
+static const RegisterOp attachedScript[] PROGMEM = {
+	{HIEN,		0x00,										(1<<CONDETIE)},
+};
+
+static const RegisterOp busResetScript[] PROGMEM = {
+	{HCTL,		(1<<BUSRST),								REG_MASK_ALL},	// Bus reset
+};
+
+static const RegisterOp frameStartScript[] PROGMEM = {
+	{MODE,		(1<<SOFKAENAB),								(1<<SOFKAENAB)},	// Enable auto gen of FS SOF packets or LS keep-alive pulses / frame markers
+};
+
+/* Enumeration states, indexed by state. Timeouts and failed requests go to retryState until the retries are used up */
+static const EnumStep enumSteps[USB_STATE_COUNT] PROGMEM = {
+	/*	entry				entryLength							dwell					timeout					retries				retryState */
+	{connectWaitScript,	SCRIPT_LENGTH(connectWaitScript),	0,						0,						0,					USB_ERROR},			// USB_DISCONNECTED
+	{connectWaitScript,	SCRIPT_LENGTH(connectWaitScript),	0,						0,						0,					USB_ERROR},			// USB_ILLEGAL_STATE
+	{NULL,				0,									0,						0,						0,					USB_ERROR},			// USB_ERROR
+	{NULL,				0,									0,						0,						0,					USB_ERROR},			// USB_DEVICE_FOUND
+	{NULL,				0,									0,						0,						0,					USB_ERROR},			// USB_INITIALIZE
+	{attachedScript,	SCRIPT_LENGTH(attachedScript),		USB_SETTLE_DELAY,		0,						0,					USB_ERROR},			// USB_SETTLE
+	{busResetScript,	SCRIPT_LENGTH(busResetScript),		0,						0,						0,					USB_ERROR},			// USB_PERIPHERAL_RESET
+	{NULL,				0,									0,						USB_BUS_RESET_TIMEOUT,	USB_ENUM_RETRIES,	USB_INITIALIZE},	// USB_WAIT_RESET
+	{frameStartScript,	SCRIPT_LENGTH(frameStartScript),	0,						USB_SOF_TIMEOUT,		USB_ENUM_RETRIES,	USB_INITIALIZE},	// USB_WAIT_SOF
+	{NULL,				0,									USB_SOF_SETTLE_DELAY,	0,						USB_ENUM_RETRIES,	USB_INITIALIZE},	// USB_GET_DEV_DESCRIPTOR
+	{NULL,				0,									0,						0,						USB_ENUM_RETRIES,	USB_INITIALIZE},	// USB_ADDRESSING
+	{NULL,				0,									0,						0,						0,					USB_ERROR},			// USB_RUNNING
+	{NULL,				0,									0,						0,						0,					USB_ERROR},			// USB_CONFIGURING
+};
 
 #define MAX_RESET	PINL6		// used to be PINH4 changed after integration
 #define GPX			PINH5
-#define INT			PINH6
+
+#ifdef MAX3421E_STATS
+	#define STATS_ADD(field, n) (stats_.field += (n))
+#else
+	#define STATS_ADD(field, n) void(0)
+#endif
+
+MAX3421E* MAX3421E::instances_[MAX3421E_INT_LINES] = {NULL};
+xSemaphoreHandle MAX3421E::anyEventSemaphore_ = NULL;
+
+ISR(INT4_vect)
+{
+	MAX3421E::HandleInterrupt(4);
+}
+
+ISR(INT5_vect)
+{
+	MAX3421E::HandleInterrupt(5);
+}
+
+ISR(INT6_vect)
+{
+	MAX3421E::HandleInterrupt(6);
+}
+
+ISR(INT7_vect)
+{
+	MAX3421E::HandleInterrupt(7);
+}
 
 // default constructor
-MAX3421E::MAX3421E()
+MAX3421E::MAX3421E(volatile uint8_t* csPort, uint8_t csPin, uint8_t intLine) : spi_(PinChipSelect(csPort,csPin))
 {
-	// Initialize SPI
-	spi_ = new SPISerial();
-	spi_->DeselectSlave();
+	// SPI is initialized and the chip deselected by the transport member
 	
 	// Initialize endpoint
 	ep_.maxPktSize = 8;
@@ -37,13 +115,67 @@ MAX3421E::MAX3421E()
 	DDRL	|= (1<<MAX_RESET);
 	PORTL	|= (1<<MAX_RESET);	// release from reset
 	
+	// Setup INT pin as external interrupt on falling edge (INT is active low with POSINT cleared)
+	intLine_ = intLine;
+	uint8_t isc = (intLine - MAX3421E_INT_FIRST) * 2;		// ISCn1:0 of INT4-INT7 in EICRB
+	DDRE	&= ~(1<<intLine);								// INTn is on PEn
+	EICRB	= (EICRB & ~(3<<isc)) | (2<<isc);
+	EIFR	= (1<<intLine);		// clear pending interrupt
+	EIMSK	|= (1<<intLine);
 	
+	// Semaphore is created available, take it so the first transfer has to wait for INT
+	vSemaphoreCreateBinary(xferSemaphore_);
+	xSemaphoreTake(xferSemaphore_,0);
+	instances_[intLine - MAX3421E_INT_FIRST] = this;
+	waitBudget_ = portMAX_DELAY;
+	
+	if (anyEventSemaphore_ == NULL){
+		vSemaphoreCreateBinary(anyEventSemaphore_);
+		xSemaphoreTake(anyEventSemaphore_,0);
+	}
+	
+#ifdef MAX3421E_STATS
+	ResetTransferStats();
+#endif
 	
 	usb_ = new UsbDevice();
 	usb_->lowspeed = false;		// is set to true if bus sample determines the device is lowspeed
 	
+	status_ = 0;
+	InvalidateShadow();
+	
+	urbHead_ = NULL;
+	urbTail_ = NULL;
+	urbLaunchTick_ = 0;
+	urbDeferred_ = NULL;
+	sndReloaded_ = false;
+#ifdef MAX3421E_SHADOW_CHECK
+	lastShadowCheck_ = 0;
+#endif
+	
+	clockDivider_ = CLOCK_DIVIDER_MIN;
+	lastClockCheck_ = 0;
+	clockChecks_ = 0;
+	clockErrors_ = 0;
+	
 	usbState_ = USB_DISCONNECTED;	// set up state machine
 	busState_ = SE0;				// set up bus state to disconnected
+	busSampled_ = false;
+	stateTick_ = 0;
+	enumRetries_ = 0;
+	memset(enumTimes_,0,sizeof(enumTimes_));
+	enumFailures_ = 0;
+	totalFailures_ = 0;
+	failTick_ = 0;
+	recoveries_ = 0;
+	recoveryTime_ = 0;
+	intTick_ = 0;
+	attachTick_ = 0;
+	busCheckTick_ = 0;
+	attachLatency_ = 0;
+	inputPending_ = false;
+	inputLatency_ = 0;
+	xferFailures_ = 0;
 }
 
 bool MAX3421E::Initialize()
@@ -59,9 +191,14 @@ bool MAX3421E::Initialize()
 		return false;
 	}
 	
-	_delay_ms(1000);
+	if (!CalibrateClock())
+	{
+		LOG_ERROR("Couldn't read back MAX3421E at any SPI clock.");
+		return false;
+	}
 	
-	WriteSingleToReg(((1<<DPPULLDN) | (1<<DMPULLDN) | (1<<HOST)),MODE);	// Pull d+ and d- low and set host mode
+	RunScript(hostModeScript,SCRIPT_LENGTH(hostModeScript));
+	busSampled_ = false;	// a device plugged in before power-up doesn't raise CONDETIRQ
 	
 	LOG_DEBUG("Successfully initialized MAX3421E.");
 
@@ -72,7 +209,101 @@ bool MAX3421E::Initialize()
 
 void MAX3421E::SetUSBState(uint8_t state){
 	//LOG_DEBUG("State: %d",state);
+	portTickType now = xTaskGetTickCount();
+	
+	if (usbState_ < USB_STATE_COUNT)
+		enumTimes_[usbState_] += (now - stateTick_) * portTICK_RATE_MS;
+	
 	usbState_ = state;
+	stateTick_ = now;
+	
+	if (state >= USB_STATE_COUNT)
+		return;
+	
+	/* Run the entry action of the new state */
+	const RegisterOp* entry = (const RegisterOp*)pgm_read_word(&enumSteps[state].entry);
+	
+	if (entry != NULL)
+		RunScript(entry,pgm_read_byte(&enumSteps[state].entryLength));
+}
+
+void MAX3421E::RetryState()
+{
+	if (enumRetries_ < pgm_read_byte(&enumSteps[usbState_].retries)){
+		enumRetries_++;
+		SetUSBState(pgm_read_byte(&enumSteps[usbState_].retryState));
+	} else {
+		FailEnumeration();
+	}
+}
+
+void MAX3421E::FailEnumeration()
+{
+	if (enumFailures_ == 0)
+		failTick_ = xTaskGetTickCount();
+	if (enumFailures_ <= USB_RECOVERY_MAX_POWER)
+		enumFailures_++;
+	totalFailures_++;
+	
+	LOG_ERROR("Enumeration failed in state %d, recovering in %u ms.",usbState_,RecoveryBackoff());	// logged once, USB_ERROR itself is silent
+	SetUSBState(USB_ERROR);
+}
+
+bool MAX3421E::CheckDisconnect()
+{
+	bool failing = xferFailures_ >= USB_DISCONNECT_FAILURES;
+	
+	if (status_ & (1<<CONDETIRQ)){
+		WriteSingleToReg((1<<CONDETIRQ),HIRQ);	// clear interrupt by writing 1
+		attachTick_ = xTaskGetTickCount();
+		ProbeBus(false);
+	} else if (failing){
+		ProbeBus(true);		// confirm with a fresh sample
+	} else {
+		return false;
+	}
+	
+	xferFailures_ = 0;
+	
+	if (failing && busState_ != SE0){
+		/* Device is attached but doesn't answer, recover like a failed enumeration */
+		FailEnumeration();
+	} else {
+		/* Unplugged, or replugged before we looked, either way it's enumerated from scratch */
+		LOG_INFO("Device disconnected.");
+		enumFailures_ = 0;
+		SetUSBState(USB_DISCONNECTED);
+	}
+	
+	return true;
+}
+
+void MAX3421E::CancelTransfers()
+{
+	portENTER_CRITICAL();
+	while (urbHead_ != NULL){
+		urbHead_->state = URB_IDLE;
+		urbHead_ = urbHead_->next;
+	}
+	urbTail_ = NULL;
+	portEXIT_CRITICAL();
+	
+	if (urbDeferred_ != NULL){
+		urbDeferred_->state = URB_IDLE;
+		urbDeferred_ = NULL;
+	}
+}
+
+uint16_t MAX3421E::RecoveryBackoff() const
+{
+	return USB_RECOVERY_DELAY << (enumFailures_ - 1);
+}
+
+void MAX3421E::PrintEnumerationTimes()
+{
+	for (uint8_t state = 0; state < USB_STATE_COUNT; state++)
+		if (enumTimes_[state] != 0)
+			LOG_DEBUG("State %d: %u ms",state,enumTimes_[state]);
 }
 
 void MAX3421E::Enumerate()
@@ -81,37 +312,62 @@ void MAX3421E::Enumerate()
 	
 	uint8_t rcode;
 
-	static uint32_t delay = 0;
-
 	// Switch on busState should've been set after initialization
 	switch(busState_)
 	{
 		case NA_STATE:	// N/A State
-			SetUSBState(USB_ILLEGAL_STATE);
+			if (usbState_ != USB_ILLEGAL_STATE)
+				SetUSBState(USB_ILLEGAL_STATE);
 			break;
 		case SE0:
-			SetUSBState(USB_DISCONNECTED);
+			if (usbState_ != USB_DISCONNECTED){
+				enumFailures_ = 0;	// device is gone, the next one starts without back-off
+				SetUSBState(USB_DISCONNECTED);
+			}
 			break;
 		case LSHOST:
 			usb_->lowspeed = true;	// device is lowspeed
 		case FSHOST:
-			/* If device is connecting we don't want to override usbstate */
-			if (usbState_ < USB_DEVICE_FOUND){
-				delay = USB_SETTLE_DELAY;
+			/* If device is connecting we don't want to override usbstate, USB_ERROR recovers on its own */
+			if (usbState_ < USB_DEVICE_FOUND && usbState_ != USB_ERROR){
+				memset(enumTimes_,0,sizeof(enumTimes_));	// new attempt, start timing from here
+				enumRetries_ = 0;
+				inputPending_ = true;
 				SetUSBState(USB_SETTLE);	
 			}
 			break;
 	}
 	
+	/* Waits are done by returning until the state's dwell time has passed, the host task never sleeps here */
+	if (usbState_ < USB_STATE_COUNT){
+		portTickType inState = xTaskGetTickCount() - stateTick_;
+		uint16_t dwell = pgm_read_word(&enumSteps[usbState_].dwell);
+		uint16_t timeout = pgm_read_word(&enumSteps[usbState_].timeout);
+		
+		if (inState < dwell / portTICK_RATE_MS)
+			return;
+		
+		if (timeout != 0 && inState >= (dwell + timeout) / portTICK_RATE_MS){
+			RetryState();
+			return;
+		}
+	}
+	
 	switch (usbState_){
 		case USB_ILLEGAL_STATE:
 		case USB_DISCONNECTED:
-			/* Probe bus to see if any device has connected */
-			ProbeBus();
+			/* Sample the bus once, after that sleep until CONDETIRQ reports a change on D+/D-, as long as the
+			   budget allows, other hosts served by this task have to wait meanwhile */
+			if (!busSampled_){
+				ProbeBus(true);
+				busSampled_ = true;
+				attachTick_ = xTaskGetTickCount();
+			} else if (WaitForBusEvent(Budget(USB_CONNECT_WAIT))){
+				ProbeBus(false);
+			}
 			break;
 		case USB_SETTLE:
-			/* Let usb device settle if it has just been connected */
-			vTaskDelay(delay/portTICK_RATE_MS);
+			/* Device has settled after being connected (dwell) */
 			SetUSBState(USB_DEVICE_FOUND);
 			break;
 		case USB_DEVICE_FOUND:
@@ -122,27 +378,26 @@ void MAX3421E::Enumerate()
 			SetUSBState(USB_PERIPHERAL_RESET);	// issue bus reset to set device into default unconfigured state
 			break;
 		case USB_PERIPHERAL_RESET:
-			WriteSingleToReg((1<<BUSRST),HCTL);	// bus reset
+			/* Bus reset was started by the entry script */
 			SetUSBState(USB_WAIT_RESET);
 			break;
 		case USB_WAIT_RESET:
 			/* Wait for bus reset to be completed */
 			if ((ReadSingleFromReg(HCTL) & (1<<BUSRST)) == 0)
 			{
-				uint8_t modeReg = ReadSingleFromReg(MODE);
-				WriteSingleToReg(modeReg | (1<<SOFKAENAB),MODE);	// Enable auto gen of FS SOF packets or LS keep-alive pulses / frame markers
-				SetUSBState(USB_WAIT_SOF);
+				SetUSBState(USB_WAIT_SOF);	// entry script enables SOF packets / keep-alives
 			}
 			break;
 		case USB_WAIT_SOF:
 			/* Wait for at least one frame marker */
 			if (ReadSingleFromReg(HIRQ) & (1<<FRAMEIRQ)){
-				delay = 20;
-				vTaskDelay(delay/portTICK_RATE_MS);	// wait to get it going
-				SetUSBState(USB_GET_DEV_DESCRIPTOR);
+				SetUSBState(USB_GET_DEV_DESCRIPTOR);	// dwells to get it going
 			}
 			break;
 		case USB_GET_DEV_DESCRIPTOR:
+			attachLatency_ = (xTaskGetTickCount() - attachTick_) * portTICK_RATE_MS;
+			LOG_DEBUG("Attach latency: %u ms",attachLatency_);
+			
 			devRecord_[0].epInfo->maxPktSize = 8;
 			rcode = GetDeviceDescriptor(0,0,sizeof(USB_DEVICE_DESCRIPTOR),(uint8_t*)&devDescBuf_);
 			if (rcode == hrSUCCES){
@@ -155,7 +410,7 @@ void MAX3421E::Enumerate()
 				
 			} else {
 				//LOG_ERROR("Failed to get device descriptor %d", rcode);
-				SetUSBState(USB_ERROR);
+				RetryState();
 			}
 			break;
 		case USB_ADDRESSING:
@@ -163,8 +418,18 @@ void MAX3421E::Enumerate()
 			if (ConfigureDevices())
 			{
 				SetUSBState(USB_CONFIGURING);
+				PrintEnumerationTimes();
+				
+				if (enumFailures_ != 0){
+					uint16_t recovery = (xTaskGetTickCount() - failTick_) * portTICK_RATE_MS;
+					
+					recoveryTime_ += recovery;
+					recoveries_++;
+					enumFailures_ = 0;
+					LOG_INFO("Recovered in %u ms (MTTR %lu ms, %u failures).",recovery,GetMeanTimeToRecover(),totalFailures_);
+				}
 			} else {
-				SetUSBState(USB_ERROR);
+				RetryState();
 			}
 			break;
 		case USB_CONFIGURING:
@@ -172,7 +437,17 @@ void MAX3421E::Enumerate()
 		case USB_RUNNING:
 			break;
 		case USB_ERROR:
-			LOG_ERROR("Error occurred while enumerating usb!");
+			/* Bus reset and enumerate again once the back-off has passed, if the device is still attached */
+			if ((portTickType)(xTaskGetTickCount() - stateTick_) >= RecoveryBackoff() / portTICK_RATE_MS){
+				if (ProbeBus(true) == SE0){
+					enumFailures_ = 0;	// device was unplugged, wait for the next one instead
+					SetUSBState(USB_DISCONNECTED);
+					break;
+				}
+				memset(enumTimes_,0,sizeof(enumTimes_));
+				enumRetries_ = 0;
+				SetUSBState(USB_INITIALIZE);
+			}
 			break;
 	}
 	
@@ -231,6 +506,11 @@ void MAX3421E::InitializeRecords()
 	ep_.bmSndToggle = SNDTOG0;   //set DATA0/1 toggles to 0
 	ep_.bmRcvToggle = RCVTOG0;
 	ep_.epAddr		= 0x00;
+	ep_.nakPolicy	= NAK_POLICY_LIMIT;
+	ep_.bmNakPower	= 0;
+	ep_.nakFrames	= 0;
+	ep_.nakCount	= 0;
+	ep_.nakGiveUps	= 0;
 	
 }
 
@@ -240,16 +520,93 @@ void MAX3421E::PrintDeviceInfo()
 		LOG_INFO("VID: %d\nPID: %d",devRecord_[1].devDescriptor->idVendor,devRecord_[1].devDescriptor->idProduct);
 }
 
+#ifdef MAX3421E_STATS
+void MAX3421E::ResetTransferStats()
+{
+	stats_.transfers	= 0;
+	stats_.spiBytes		= 0;
+	stats_.busyCycles	= 0;
+}
 
-uint8_t MAX3421E::ProbeBus()
+void MAX3421E::PrintTransferStats()
+{
+	if (stats_.transfers == 0)
+		return;
+	
+	LOG_INFO("Transfers: %lu SPI bytes/transfer: %lu Cycles/transfer: %lu",stats_.transfers,
+		stats_.spiBytes / stats_.transfers, stats_.busyCycles / stats_.transfers);
+}
+
+void MAX3421E::BenchmarkSerial()
+{
+	uint8_t buffer[SERIAL_BENCHMARK_BYTES];
+	uint8_t address = ReadShadowedReg(PERADDR);
+	uint8_t errors = 0;
+	uint32_t start;
+	
+	// Register round trip, a PERADDR write and read-back with the chip selected for each access
+	start = Timebase::Cycles();
+	for (uint8_t i = 0; i < SERIAL_BENCHMARK_ROUNDS; i++){
+		WriteSingleToReg(i & 0x7F,PERADDR);		// PERADDR holds 7 bits
+		if (ReadSingleFromReg(PERADDR) != (i & 0x7F))
+			errors++;
+	}
+	uint32_t roundTrip = (Timebase::Cycles() - start) / SERIAL_BENCHMARK_ROUNDS;
+	
+	// Burst read, non-FIFO registers don't auto-increment so this has the bus timing of a RCVFIFO drain
+	WriteSingleToReg(address,PERADDR);
+	start = Timebase::Cycles();
+	ReadMultipleFromReg(buffer,PERADDR,sizeof(buffer));
+	uint32_t burst = Timebase::Cycles() - start;
+	
+	for (uint8_t i = 0; i < sizeof(buffer); i++)
+		if (buffer[i] != address)
+			errors++;
+	
+	LOG_INFO("Register round trip: %lu cycles burst: %lu cycles (%d bytes) errors: %d",roundTrip,burst,sizeof(buffer),errors);
+}
+#endif
+
+void MAX3421E::HandleInterrupt(uint8_t line)
+{
+	MAX3421E* instance = instances_[line - MAX3421E_INT_FIRST];
+	
+	if (instance == NULL)
+		return;
+	
+	instance->intTick_ = xTaskGetTickCountFromISR();
+	
+	signed portBASE_TYPE woken = pdFALSE;
+	xSemaphoreGiveFromISR(instance->xferSemaphore_,&woken);
+	xSemaphoreGiveFromISR(anyEventSemaphore_,&woken);
+	
+	/* Same policy as the SPI interrupt, switch to the woken task right away */
+	if (woken != pdFALSE)
+		taskYIELD();
+}
+
+
+uint8_t MAX3421E::ProbeBus(bool sample)
 {
 	/* Inspired by https://github.com/felis/USB_Host_Shield_2.0 */
 	/* and https://pdfserv.maximintegrated.com/en/an/AN3785.pdf */
 	
 	/* Sample bus to determine wether a device is connected */
-	WriteSingleToReg((1<<SAMPLEBUS),HCTL);	// sample d+ and d-
+	if (sample){
+		uint8_t polls;
+		
+		WriteSingleToReg((1<<SAMPLEBUS),HCTL);	// sample d+ and d-
 		
-	while(!(ReadSingleFromReg(HCTL) & (1<<SAMPLEBUS)));	// wait for sampling to be done (sie clears samplebus bit)
+		// wait for sampling to be done (sie clears samplebus bit)
+		for (polls = 0; polls < USB_SAMPLE_TIMEOUT; polls++)
+			if (ReadSingleFromReg(HCTL) & (1<<SAMPLEBUS))
+				break;
+		
+		if (polls == USB_SAMPLE_TIMEOUT){
+			LOG_ERROR("Bus sample timed out.");
+			return busState_;
+		}
+	}
 	
 	// Read the sample from HRSL
 	uint8_t busSample = ReadSingleFromReg(HRSL);
@@ -257,7 +614,7 @@ uint8_t MAX3421E::ProbeBus()
 	// Only examine J and K bits
 	busSample &= ((1<<JSTATUS) | (1<<KSTATUS));
 	
-	uint8_t lowspeed = ReadSingleFromReg(MODE) & (1<<LOWSPEED);	// meaning of j and k state depends on LOWSPEED bit
+	uint8_t lowspeed = ReadShadowedReg(MODE) & (1<<LOWSPEED);	// meaning of j and k state depends on LOWSPEED bit
 	
 	/* Switch on KSTATUS and JSTATUS bits to determine mode */
 	switch(busSample)
@@ -306,102 +663,392 @@ uint8_t MAX3421E::ProbeBus()
 
 void MAX3421E::WriteMultipleToReg(uint8_t* bytes,uint8_t reg, uint16_t length)
 {
-	uint8_t command = ((reg<<3) | (1<<1));	// Shift register to REG0-REG4 and set WR-bit
+	SerialSegment job = {REG_WRITE(reg), bytes, NULL, length, 0};
+	
+	spi_.Execute(&job,1);
+	status_ = job.status;	// Chip clocks out HIRQ while receiving the command
 	
-	spi_->SelectSlave();
-	spi_->WriteByte(command);
-	spi_->WriteBytes(bytes,length);
-	spi_->DeselectSlave();
+	STATS_ADD(spiBytes,1 + length);
 }
 
-void MAX3421E::WriteSingleToReg(uint8_t byte,uint8_t reg)
+uint8_t MAX3421E::WriteSingleToReg(uint8_t byte,uint8_t reg)
 {
 	uint8_t command = ((reg<<3) | 0x02);	// Shift register to REG0-REG4 and set WR-bit (1)
 	
-	spi_->SelectSlave();
-	spi_->WriteByte(command);
-	spi_->WriteByte(byte);
-	spi_->DeselectSlave();
+	spi_.SelectSlave();
+	status_ = spi_.WriteByte(command);		// Chip clocks out HIRQ while receiving the command
+	spi_.WriteByte(byte);
+	spi_.DeselectSlave();
+	
+	STATS_ADD(spiBytes,2);
+	
+	UpdateShadow(byte,reg);	// Write-through to the shadow cache
+	
+	return status_;
 }
 
+uint8_t MAX3421E::RunScript(const RegisterOp* script, uint8_t count)
+{
+	SerialSegment job[REG_SCRIPT_MAX];
+	uint8_t values[REG_SCRIPT_MAX];
+	
+	if (count == 0)
+		return status_;		// nothing to write, HIRQ of the last access is all there is
+	
+	if (count > REG_SCRIPT_MAX)
+		count = REG_SCRIPT_MAX;
+	
+	/* Resolve every op first, a masked op sees the values written by the ops before it */
+	for (uint8_t i = 0; i < count; i++){
+		uint8_t reg = pgm_read_byte(&script[i].reg);
+		uint8_t value = pgm_read_byte(&script[i].value);
+		uint8_t mask = pgm_read_byte(&script[i].mask);
+		
+		if (mask != REG_MASK_ALL)
+			value = (ReadShadowedReg(reg) & ~mask) | (value & mask);
+		
+		values[i] = value;
+		job[i].command = REG_WRITE(reg);
+		job[i].tx = &values[i];
+		job[i].rx = NULL;
+		job[i].len = 1;
+		
+		UpdateShadow(value,reg);
+	}
+	
+	spi_.Execute(job,count);
+	status_ = job[count-1].status;	// Chip clocks out HIRQ while receiving the command
+	
+	STATS_ADD(spiBytes,2*count);
+	
+	return status_;
+}
+
+int8_t MAX3421E::ShadowIndex(uint8_t reg)
+{
+	switch (reg){
+		case MODE:		return SHADOW_MODE;
+		case PERADDR:	return SHADOW_PERADDR;
+		case HIEN:		return SHADOW_HIEN;
+		default:		return SHADOW_NONE;
+	}
+}
+
+void MAX3421E::UpdateShadow(uint8_t byte, uint8_t reg)
+{
+	int8_t idx = ShadowIndex(reg);
+	
+	if (idx != SHADOW_NONE){
+		shadow_[idx] = byte;
+		shadowValid_ |= (1<<idx);
+	}
+}
+
+void MAX3421E::WriteShadowedReg(uint8_t byte, uint8_t reg)
+{
+	int8_t idx = ShadowIndex(reg);
+	
+	// Skip the write if the chip already holds the value
+	if (idx != SHADOW_NONE && (shadowValid_ & (1<<idx)) && shadow_[idx] == byte)
+		return;
+	
+	WriteSingleToReg(byte,reg);
+}
+
+uint8_t MAX3421E::ReadShadowedReg(uint8_t reg)
+{
+	int8_t idx = ShadowIndex(reg);
+	
+	if (idx == SHADOW_NONE)
+		return ReadSingleFromReg(reg);
+	
+	if (!(shadowValid_ & (1<<idx))){
+		shadow_[idx] = ReadSingleFromReg(reg);
+		shadowValid_ |= (1<<idx);
+	}
+	
+	return shadow_[idx];
+}
+
+bool MAX3421E::CalibrateClock()
+{
+	static const uint8_t patterns[] = {0x55, 0x2A, 0x00, 0x7F, 0x33, 0x4C, 0x01, 0x40};	// PERADDR holds 7 bits
+	bool passed = false;
+	
+	// Fastest first, every step halves the clock
+	for (uint16_t divider = CLOCK_DIVIDER_MIN; divider <= CLOCK_DIVIDER_MAX && !passed; divider <<= 1){
+		spi_.SetClockDivider(divider);
+		clockDivider_ = divider;
+		passed = true;
+		
+		for (uint8_t round = 0; round < CLOCK_CAL_ROUNDS && passed; round++){
+			for (uint8_t i = 0; i < sizeof(patterns) && passed; i++){
+				WriteSingleToReg(patterns[i],PERADDR);
+				passed = (ReadSingleFromReg(PERADDR) == patterns[i]);
+			}
+		}
+	}
+	
+	WriteSingleToReg(0x00,PERADDR);		// Back to the default address (also resets the shadow)
+	
+	if (passed)
+		LOG_INFO("SPI clock: fosc/%d",clockDivider_);
+	
+	return passed;
+}
+
+void MAX3421E::MonitorClock()
+{
+	// Only check every CLOCK_CHECK_INTERVAL ms
+	portTickType now = xTaskGetTickCount();
+	if ((portTickType)(now - lastClockCheck_) < CLOCK_CHECK_INTERVAL/portTICK_RATE_MS)
+		return;
+	lastClockCheck_ = now;
+	
+	/* PERADDR is shadowed, so a read-back that doesn't match got corrupted on the bus */
+	uint8_t expected = ReadShadowedReg(PERADDR);
+	if (ReadSingleFromReg(PERADDR) != expected)
+		clockErrors_++;
+	
+	if (clockErrors_ >= CLOCK_ERROR_LIMIT && clockDivider_ < CLOCK_DIVIDER_MAX){
+		clockDivider_ <<= 1;
+		spi_.SetClockDivider(clockDivider_);
+		LOG_ERROR("SPI read-back errors, clock stepped down to fosc/%d",clockDivider_);
+		
+		WriteSingleToReg(expected,PERADDR);		// The corrupted access might have been a write
+		clockErrors_ = 0;
+		clockChecks_ = 0;
+	}
+	
+	if (++clockChecks_ >= CLOCK_ERROR_WINDOW){
+		clockErrors_ = 0;
+		clockChecks_ = 0;
+	}
+}
+
+#ifdef MAX3421E_SHADOW_CHECK
+bool MAX3421E::CheckShadow()
+{
+	static const uint8_t shadowedRegs[SHADOW_COUNT] = {MODE, PERADDR, HIEN};
+	bool match = true;
+	
+	// Only check every SHADOW_CHECK_INTERVAL ms
+	portTickType now = xTaskGetTickCount();
+	if ((portTickType)(now - lastShadowCheck_) < SHADOW_CHECK_INTERVAL/portTICK_RATE_MS)
+		return true;
+	lastShadowCheck_ = now;
+	
+	for (uint8_t i = 0; i < SHADOW_COUNT; i++){
+		if (!(shadowValid_ & (1<<i)))
+			continue;
+		
+		uint8_t actual = ReadSingleFromReg(shadowedRegs[i]);
+		if (actual != shadow_[i]){
+			LOG_ERROR("Shadow mismatch reg %d: shadow %d chip %d",shadowedRegs[i],shadow_[i],actual);
+			shadow_[i] = actual;
+			match = false;
+		}
+	}
+	
+	return match;
+}
+#endif
+
 uint8_t MAX3421E::ReadSingleFromReg(uint8_t reg)
 {
-	spi_->SelectSlave();
+	spi_.SelectSlave();
 	uint8_t command = ((reg<<3));			// Shift register to REG0-REG4 and set R-bit (0)
-	spi_->WriteByte(command);				// Send read command
-	uint8_t result = spi_->ReadByte();		// Sends empty byte and read
-	spi_->DeselectSlave();
+	status_ = spi_.WriteByte(command);		// Send read command
+	uint8_t result = spi_.ReadByte();		// Sends empty byte and read
+	spi_.DeselectSlave();
+	
+	STATS_ADD(spiBytes,2);
 	return result;
 }
 
 uint8_t* MAX3421E::ReadMultipleFromReg(uint8_t* datacontainer, uint8_t reg, uint8_t len)
 {	
-	// Send register read command
-	spi_->SelectSlave();
-	uint8_t command = ((reg<<3));			// Shift register to REG0-REG4 and set R-bit (0)
-	spi_->WriteByte(command);				// Send read command
+	SerialSegment job = {REG_READ(reg), NULL, datacontainer, len, 0};
 	
-	// Start reading bytes
-	while(len--)
-		*datacontainer++ = spi_->ReadByte();
+	spi_.Execute(&job,1);
+	status_ = job.status;	// Chip clocks out HIRQ while receiving the command
+	
+	STATS_ADD(spiBytes,1 + len);
+	
+	return datacontainer + len;
+}
+
+bool MAX3421E::WaitForTransferDone(uint8_t* hrsl, portTickType deadline)
+{
+	while (1){
+#ifdef MAX3421E_STATS
+		uint32_t blockStart = Timebase::Cycles();
+#endif
+		
+		/* Sleep until INT signals the transfer is done, other tasks get the CPU meanwhile. HIRQ is polled
+		   every USB_XFER_IRQ_TIMEOUT ticks as well, so an edge that was missed isn't lost */
+		portTickType wait = deadline - xTaskGetTickCount();
+		if (DeadlinePassed(deadline) || wait > USB_XFER_IRQ_TIMEOUT)
+			wait = USB_XFER_IRQ_TIMEOUT;
+		xSemaphoreTake(xferSemaphore_,wait);
+		
+#ifdef MAX3421E_STATS
+		blockedCycles_ += Timebase::Cycles() - blockStart;
+#endif
+		
+		if (PollTransferDone(hrsl))
+			return true;
 		
-	spi_->DeselectSlave();
+		if (DeadlinePassed(deadline))
+			return false;
+	}
+}
+
+void MAX3421E::StopTransferEngine()
+{
+	/* HXFRDNIRQ never came, a bus reset is the only way to stop the SIE. The device loses its address,
+	   so CheckDisconnect sends the host back to enumeration */
+	LOG_ERROR("Token never completed, resetting the bus.");
+	RunScript(busResetScript,SCRIPT_LENGTH(busResetScript));
+	xferFailures_ = USB_DISCONNECT_FAILURES;
+}
+
+bool MAX3421E::WaitForAnyEvent(portTickType wait)
+{
+	return xSemaphoreTake(anyEventSemaphore_,wait) == pdTRUE;
+}
+
+bool MAX3421E::WaitForBusEvent(portTickType wait)
+{
+	bool woken = xSemaphoreTake(xferSemaphore_,wait) == pdTRUE;
+	portTickType now = xTaskGetTickCount();
+	
+	if (!woken && wait < USB_CONNECT_WAIT && (portTickType)(now - busCheckTick_) < USB_CONNECT_WAIT)
+		return false;
+	
+	busCheckTick_ = now;
+	
+	if (!(ReadSingleFromReg(HIRQ) & (1<<CONDETIRQ)))
+		return false;
 	
-	return datacontainer;
+	WriteSingleToReg((1<<CONDETIRQ),HIRQ);	// clear interrupt by writing 1
+	
+	if (woken){
+		portENTER_CRITICAL();
+		attachTick_ = intTick_;		// edge was caught, the bus changed when INT fired
+		portEXIT_CRITICAL();
+	} else {
+		attachTick_ = now;
+	}
+	
+	return true;
 }
 
-uint8_t MAX3421E::DispatchPacket(uint8_t token, uint8_t ep, uint8_t naklimit)
- { 	 	
+bool MAX3421E::PollTransferDone(uint8_t* hrsl)
+{
+	/* HRSL is needed anyway and HIRQ comes along in the status byte */
+	*hrsl = ReadSingleFromReg(HRSL);
+	
+	if (status_ & (1<<HXFRDNIRQ))
+	{
+		// Reset interrupt bit
+		WriteSingleToReg((1<<HXFRDNIRQ),HIRQ);
+		return true;
+	}
+	
+	return false;
+}
+
+void MAX3421E::LaunchSetup(const uint8_t* setup, uint8_t ep)
+{
+	uint8_t clear = (1<<HXFRDNIRQ);
+	uint8_t hxfr = (SETUP_TOKEN|ep);
+	SerialSegment job[3] = {
+		{REG_WRITE(HIRQ), &clear, NULL, 1, 0},		// a late HXFRDNIRQ of an aborted token would end this one
+		{REG_WRITE(SUDFIFO), setup, NULL, 8, 0},
+		{REG_WRITE(HXFR), &hxfr, NULL, 1, 0}
+	};
+	
+	xSemaphoreTake(xferSemaphore_,0);	// Drop completion left over from an earlier transfer
+	spi_.Execute(job,3);
+	status_ = job[2].status;
+	
+	STATS_ADD(spiBytes,13);
+	STATS_ADD(transfers,1);
+}
+
+void MAX3421E::LaunchPacket(uint8_t token, uint8_t ep)
+{
+	uint8_t clear = (1<<HXFRDNIRQ);
+	uint8_t hxfr = (token|ep);
+	SerialSegment job[2] = {
+		{REG_WRITE(HIRQ), &clear, NULL, 1, 0},		// a late HXFRDNIRQ of an aborted token would end this one
+		{REG_WRITE(HXFR), &hxfr, NULL, 1, 0}		// Launch transfer
+	};
+	
+	xSemaphoreTake(xferSemaphore_,0);	// Drop completion left over from an earlier transfer
+	spi_.Execute(job,2);
+	status_ = job[1].status;
+	
+	STATS_ADD(spiBytes,4);
+	STATS_ADD(transfers,1);
+}
+
+uint8_t MAX3421E::FinishPacket(uint8_t token, uint8_t ep, uint8_t naklimit, EpInfo* pep, portTickType deadline,
+uint8_t* outData, uint8_t outSize)
+{
 	/* Inspired by https://github.com/felis/USB_Host_Shield_2.0 */
 	
-	uint8_t timeoutDispatch = 1;
-	uint8_t timeout = 1;
 	uint8_t rcode = hrSUCCES;
-	uint8_t temp;
+	uint8_t hrsl;
+	bool done = false;
 	
 	uint16_t nakCount	= 0;
 	uint16_t retryCount	= 0;
+	portTickType firstNak = 0;
+	uint8_t backoff;
 	
-	while(++timeoutDispatch){
-		
-		WriteSingleToReg((token|ep),HXFR);	// Launch transfer
-		
-		rcode = 0xFF;
+	sndReloaded_ = false;
+	
+#ifdef MAX3421E_STATS
+	uint32_t start = Timebase::Cycles();
+	blockedCycles_ = 0;
+#endif
+	
+	while(1){
 		
-		while(++timeout){
-			 
-			temp = ReadSingleFromReg(HIRQ);
-	 	
-			if (temp & (1<<HXFRDNIRQ))
-			{
-				// Reset interrupt bit
-	 			WriteSingleToReg((1<<HXFRDNIRQ),HIRQ);
-				rcode = hrSUCCES;
-	 			break;
+		if (!WaitForTransferDone(&hrsl,deadline)){
+			// Token may still be on the wire, give it a last chance before the SIE is stopped
+			if (!WaitForTransferDone(&hrsl,xTaskGetTickCount() + USB_XFER_ABORT_TIMEOUT)){
+				StopTransferEngine();
+				rcode = 0xFF;
+				break;
 			}
 		}
 	
-		if (rcode != hrSUCCES){	// timeout occured return the rcode
-			//LOG_ERROR("DispatchPacket - Timeout occured");
-			return rcode;
-		}
-	
 		// Analyze the return code (could be NAK, timeout on USB or bad request)
-		rcode = (ReadSingleFromReg(HRSL) & 0x0f);
+		rcode = (hrsl & 0x0f);
 		
 		switch (rcode){
 			case hrNAK:
-				nakCount++;
-				if (nakCount > naklimit){
+				if (nakCount++ == 0)
+					firstNak = xTaskGetTickCount();
+				
+				backoff = NakBackoff(pep,nakCount,firstNak,naklimit);
+				if (backoff == NAK_GIVE_UP){
 					//LOG_ERROR("Hit NAK limit.");
-					return rcode;
+					done = true;
+				} else if (backoff > 0){
+					/* Endpoint has nothing to say and backs off. The driver doesn't sleep on the shared USB task,
+					   the caller gets hrNAK and asks again later (SubmitTransfer defers the request instead) */
+					done = true;
 				}
 				break;
 			case hrTIMEOUT:
 				retryCount++;
 				if (retryCount > retryLimit_){
 					//LOG_ERROR("Hit retry limit.");
-					return rcode;
+					done = true;
 				}
 				break;
 			case hrSTALL:
@@ -409,18 +1056,438 @@ uint8_t MAX3421E::DispatchPacket(uint8_t token, uint8_t ep, uint8_t naklimit)
 				retryCount++;
 				if (retryCount > retryLimit_){
 					//LOG_ERROR("Hit retry limit.");
-					return rcode;
+					done = true;
 				}
 				break;
 			default:
-				return rcode;
-		} 
+				done = true;
+				break;
+		}
+		
+		// Out of time, hand the last rcode to the caller
+		if (done || DeadlinePassed(deadline))
+			break;
+		
+		// A NAK'ed OUT packet has to be loaded again, after timeouts the SIE still holds it
+		if (rcode == hrNAK && outData != NULL){
+			ReloadSndFifo(outData,outSize);
+			sndReloaded_ = true;
+		}
+		
+		LaunchPacket(token,ep);		// Retry
 	}
 	
+#ifdef MAX3421E_STATS
+	stats_.busyCycles += (Timebase::Cycles() - start) - blockedCycles_;
+#endif
+	
 	return rcode;
- }
+}
+
+uint8_t MAX3421E::NakBackoff(EpInfo* pep, uint16_t nakCount, portTickType firstNak, uint8_t naklimit)
+{
+	uint8_t policy = (pep != NULL) ? pep->nakPolicy : NAK_POLICY_LIMIT;
+	uint8_t backoff = 0;
+	
+	if (pep != NULL)
+		pep->nakCount++;
+	
+	switch (policy){
+		case NAK_POLICY_BACKOFF:
+		{
+			if (nakCount > naklimit){
+				backoff = NAK_GIVE_UP;
+				break;
+			}
+			
+			// Wait 1, 2, 4 .. frames, capped at 2^bmNakPower
+			uint8_t power = (nakCount - 1 < pep->bmNakPower) ? nakCount - 1 : pep->bmNakPower;
+			if (power > NAK_MAX_POWER)
+				power = NAK_MAX_POWER;
+			backoff = (1<<power);
+			break;
+		}
+		case NAK_POLICY_FRAMES:
+			if ((portTickType)(xTaskGetTickCount() - firstNak) >= pep->nakFrames)
+				backoff = NAK_GIVE_UP;
+			break;
+		default:
+			if (nakCount > naklimit)
+				backoff = NAK_GIVE_UP;
+			break;
+	}
+	
+	if (backoff == NAK_GIVE_UP && pep != NULL)
+		pep->nakGiveUps++;
+	
+	return backoff;
+}
+
+uint8_t MAX3421E::DispatchPacket(uint8_t token, uint8_t ep, uint8_t naklimit, uint16_t timeout)
+{
+	portTickType deadline = xTaskGetTickCount() + timeout;
+	
+	LaunchPacket(token,ep);
+	return FinishPacket(token,ep,naklimit,NULL,deadline);
+}
+
+bool MAX3421E::SubmitTransfer(TransferRequest* request)
+{
+	if (request == NULL || request->ep == NULL)
+		return false;
+	
+	if (request->state == URB_QUEUED || request->state == URB_IN_FLIGHT)
+		return false;
+	
+	// A deferred request keeps its progress and stays in URB_BACKOFF, so ServiceTransfers resumes it
+	if (request->state != URB_BACKOFF){
+		request->actual		= 0;
+		request->nakCount	= 0;
+		request->retryCount	= 0;
+		request->rcode		= hrBUSY;
+		request->state		= URB_QUEUED;
+	}
+	request->next		= NULL;
+	
+	// Append to queue, other tasks may submit while the USB task services the queue
+	portENTER_CRITICAL();
+	if (urbTail_ == NULL)
+		urbHead_ = request;
+	else
+		urbTail_->next = request;
+	urbTail_ = request;
+	portEXIT_CRITICAL();
+	
+	return true;
+}
+
+bool MAX3421E::ServiceTransfers(portTickType wait)
+{
+	TransferRequest* request = urbHead_;
+	uint8_t hrsl;
+	
+	if (request == NULL)
+		return false;
+	
+	if (request->state == URB_QUEUED){
+		StartTransfer(request);
+		
+		// Request could have failed before anything was launched
+		if (request->state != URB_IN_FLIGHT)
+			return urbHead_ != NULL;
+	} else if (request->state == URB_BACKOFF){
+		ResumeTransfer(request);
+		return true;
+	}
+	
+	/* Sleep until INT signals the token is done */
+	if (xSemaphoreTake(xferSemaphore_,wait) != pdTRUE
+		&& (portTickType)(xTaskGetTickCount() - urbLaunchTick_) < USB_XFER_IRQ_TIMEOUT)
+		return true;	// Token is still on the wire
+	
+	/* Past USB_XFER_IRQ_TIMEOUT HIRQ is polled on every call, the token is given up only when the SIE is stopped */
+	if (PollTransferDone(&hrsl)){
+		AdvanceTransfer(request,hrsl & 0x0f);
+	} else if ((portTickType)(xTaskGetTickCount() - urbLaunchTick_) >= USB_XFER_ABORT_TIMEOUT){
+		StopTransferEngine();
+		CompleteTransfer(request,0xFF);	// timeout occured
+	}
+	
+	return urbHead_ != NULL;
+}
+
+bool MAX3421E::TransferIsIn(const TransferRequest* request) const
+{
+	if (request->token == SETUP_TOKEN)
+		return (request->setup[0] & 0x80);	// in-transfers has bit 7 set.
+	
+	return (request->token == IN_TOKEN);
+}
+
+uint8_t MAX3421E::StageToken(const TransferRequest* request) const
+{
+	bool in = TransferIsIn(request);
+	
+	switch (request->stage){
+		case URB_STAGE_SETUP:
+			return SETUP_TOKEN;
+		case URB_STAGE_STATUS:
+			return (in) ? OUT_HANDSHAKE_TOKEN : IN_HANDSHAKE_TOKEN;
+		default:
+			return (in) ? IN_TOKEN : OUT_TOKEN;
+	}
+}
+
+bool MAX3421E::StartDataStage(TransferRequest* request)
+{
+	EpInfo* pep = request->ep;
+	
+	request->stage = URB_STAGE_DATA;
+	
+	if (!TransferIsIn(request)){
+		// Set toggle value
+		WriteSingleToReg((pep->bmSndToggle) ? (1<<SNDTOG1) : (1<<SNDTOG0),HCTL);
+		
+		// If sendbuffer is available (HIRQ was clocked out while writing the toggle)
+		if ((status_ & (1<<SNDBAVIRQ)) == 0 || pep->maxPktSize == 0){
+			CompleteTransfer(request,hrBUFFERFULL);
+			return false;
+		}
+		
+		request->pktSize = (request->length < pep->maxPktSize) ? request->length : pep->maxPktSize;
+		LoadSndFifo(request->data,request->pktSize);
+	} else {
+		// Set toggle value
+		WriteSingleToReg((pep->bmRcvToggle) ? (1<<RCVTOG1) : (1<<RCVTOG0),HCTL);
+	}
+	
+	return true;
+}
+
+void MAX3421E::StartTransfer(TransferRequest* request)
+{
+	SetAddress(request->address);
+	
+	if (request->token == SETUP_TOKEN){
+		request->stage = URB_STAGE_SETUP;
+		request->state = URB_IN_FLIGHT;
+		LaunchSetup(request->setup,request->ep->epAddr);	// Load into SUDFIFO and launch as one job
+		urbLaunchTick_ = xTaskGetTickCount();
+		return;
+	}
+	
+	if (!StartDataStage(request))
+		return;
+	
+	request->state = URB_IN_FLIGHT;
+	LaunchPacket(StageToken(request),request->ep->epAddr);
+	urbLaunchTick_ = xTaskGetTickCount();
+}
+
+void MAX3421E::AdvanceTransfer(TransferRequest* request, uint8_t result)
+{
+	EpInfo* pep = request->ep;
+	bool in = TransferIsIn(request);
+	bool dataDone = false;
+	
+	switch (result){
+		case hrNAK:
+		{
+			if (request->nakCount++ == 0)
+				request->firstNak = xTaskGetTickCount();
+			
+			uint8_t backoff = NakBackoff(pep,request->nakCount,request->firstNak,request->naklimit);
+			if (backoff == NAK_GIVE_UP){
+				CompleteTransfer(request,result);
+				return;
+			}
+			
+			// Off the chip until the back-off has passed, the scheduler submits it again
+			if (backoff > 0){
+				DeferTransfer(request,backoff);
+				return;
+			}
+			
+			if (StageToken(request) == OUT_TOKEN)
+				ReloadSndFifo(request->data + request->actual,request->pktSize);
+			break;
+		}
+		case hrTIMEOUT:
+		case hrSTALL:
+			if (++request->retryCount > retryLimit_){
+				CompleteTransfer(request,result);
+				return;
+			}
+			break;
+		case hrTOGERR:
+			/* TOGERR indicates error on the toggle therefor we check the toggle again */
+			if (in){
+				pep->bmRcvToggle = (ReadSingleFromReg(HRSL) & (1<<RCVTOGRD) ? 0 : 1);
+				WriteSingleToReg((pep->bmRcvToggle) ? (1<<RCVTOG1) : (1<<RCVTOG0),HCTL);
+			} else {
+				pep->bmSndToggle = (ReadSingleFromReg(HRSL) & (1<<SNDTOGRD) ? 0 : 1);
+				WriteSingleToReg((pep->bmSndToggle) ? (1<<SNDTOG1) : (1<<SNDTOG0),HCTL);
+			}
+			break;
+		case hrSUCCES:
+			if (request->stage == URB_STAGE_SETUP){
+				
+				if (request->length == 0 || request->data == NULL){
+					request->stage = URB_STAGE_STATUS;
+				} else {
+					// Data stage of a control transfer always starts with DATA1
+					if (in)
+						pep->bmRcvToggle = 1;
+					else
+						pep->bmSndToggle = 1;
+					
+					if (!StartDataStage(request))
+						return;
+				}
+				
+			} else if (request->stage == URB_STAGE_STATUS){
+				CompleteTransfer(request,hrSUCCES);
+				return;
+				
+			} else if (in){
+				uint8_t nRecieved = ReadSingleFromReg(RCVBC);
+				
+				// RCVDAVIRQ is asserted if data was recieved without errors
+				if ((status_ & (1<<RCVDAVIRQ)) == 0){
+					CompleteTransfer(request,hrRECIEVE_ERROR);
+					return;
+				}
+				
+				uint16_t rest = request->length - request->actual;
+				ReadMultipleFromReg(request->data + request->actual,RCVFIFO,(nRecieved < rest) ? nRecieved : rest);
+				WriteSingleToReg((1<<RCVDAVIRQ),HIRQ);		// Clear the IRQ & free the buffer
+				request->actual += (nRecieved < rest) ? nRecieved : rest;
+				
+				// Short packet or all bytes recieved ends the transfer
+				if (nRecieved < pep->maxPktSize || request->actual >= request->length){
+					pep->bmRcvToggle = (ReadSingleFromReg(HRSL) & (1<<RCVTOGRD) ? 1 : 0);
+					dataDone = true;
+				}
+				
+			} else {
+				request->actual += request->pktSize;
+				
+				if (request->actual >= request->length){
+					pep->bmSndToggle = (ReadSingleFromReg(HRSL) & (1<<SNDTOGRD) ? 1 : 0);
+					dataDone = true;
+				} else {
+					uint16_t rest = request->length - request->actual;
+					request->pktSize = (rest < pep->maxPktSize) ? rest : pep->maxPktSize;
+					LoadSndFifo(request->data + request->actual,request->pktSize);
+				}
+			}
+			
+			// Control transfers go on with the status stage, others are done
+			if (dataDone){
+				if (request->token != SETUP_TOKEN){
+					CompleteTransfer(request,hrSUCCES);
+					return;
+				}
+				request->stage = URB_STAGE_STATUS;
+			}
+			
+			// NAK and retry counts start over for the next packet
+			request->nakCount	= 0;
+			request->retryCount	= 0;
+			break;
+		default:
+			CompleteTransfer(request,result);
+			return;
+	}
+	
+	// Launch the next (or the same) packet
+	LaunchPacket(StageToken(request),pep->epAddr);
+	urbLaunchTick_ = xTaskGetTickCount();
+}
+
+void MAX3421E::DeferTransfer(TransferRequest* request, uint8_t backoff)
+{
+	EpInfo* pep = request->ep;
+	
+	// The toggle registers are shared by all requests, keep the one of the NAK'ed packet
+	if (request->stage == URB_STAGE_DATA){
+		uint8_t hrsl = ReadSingleFromReg(HRSL);
+		
+		if (TransferIsIn(request))
+			pep->bmRcvToggle = (hrsl & (1<<RCVTOGRD)) ? 1 : 0;
+		else
+			pep->bmSndToggle = (hrsl & (1<<SNDTOGRD)) ? 1 : 0;
+	}
+	
+	portENTER_CRITICAL();
+	urbHead_ = request->next;
+	if (urbHead_ == NULL)
+		urbTail_ = NULL;
+	portEXIT_CRITICAL();
+	
+	request->next		= NULL;
+	request->retryTick	= xTaskGetTickCount() + backoff;
+	request->state		= URB_BACKOFF;
+	urbDeferred_		= request;	// only the request on the wire can be NAK'ed, so one slot is enough
+}
+
+void MAX3421E::ResumeTransfer(TransferRequest* request)
+{
+	EpInfo* pep = request->ep;
+	
+	SetAddress(request->address);
+	
+	if (request->stage == URB_STAGE_DATA){
+		if (TransferIsIn(request)){
+			WriteSingleToReg((pep->bmRcvToggle) ? (1<<RCVTOG1) : (1<<RCVTOG0),HCTL);
+		} else {
+			WriteSingleToReg((pep->bmSndToggle) ? (1<<SNDTOG1) : (1<<SNDTOG0),HCTL);
+			ReloadSndFifo(request->data + request->actual,request->pktSize);	// NAK'ed OUT packet
+		}
+	}
+	
+	request->state = URB_IN_FLIGHT;
+	LaunchPacket(StageToken(request),pep->epAddr);
+	urbLaunchTick_ = xTaskGetTickCount();
+}
+
+TransferRequest* MAX3421E::TakeDeferredTransfer()
+{
+	TransferRequest* request = urbDeferred_;
+	
+	urbDeferred_ = NULL;
+	return request;
+}
 
-uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest, uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, uint8_t* data)
+void MAX3421E::CompleteTransfer(TransferRequest* request, uint8_t rcode)
+{
+	portENTER_CRITICAL();
+	urbHead_ = request->next;
+	if (urbHead_ == NULL)
+		urbTail_ = NULL;
+	portEXIT_CRITICAL();
+	
+	request->next	= NULL;
+	request->rcode	= rcode;
+	request->state	= URB_DONE;
+	
+	/* Errors in a row mean the device is gone or hung, see CheckDisconnect */
+	if (rcode == hrSUCCES || rcode == hrNAK)
+		xferFailures_ = 0;
+	else if (xferFailures_ < USB_DISCONNECT_FAILURES)
+		xferFailures_++;
+	
+	if (inputPending_ && rcode == hrSUCCES && request->token == IN_TOKEN){
+		inputPending_ = false;
+		inputLatency_ = (xTaskGetTickCount() - attachTick_) * portTICK_RATE_MS;
+		LOG_DEBUG("Attach to first input: %u ms",inputLatency_);
+	}
+	
+	// Callback may resubmit the request
+	if (request->callback != NULL)
+		request->callback(request,request->context);
+}
+
+void MAX3421E::CompleteActiveTransfer()
+{
+	while (urbHead_ != NULL && urbHead_->state == URB_IN_FLIGHT)
+		ServiceTransfers(USB_XFER_IRQ_TIMEOUT);
+}
+
+uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest, uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, uint8_t* data, uint16_t timeout)
+{
+	return ControlTransfer(address,ep,bmRequestType,bRequest,wValueLow,wValueHigh,wIdx,wLength,data,NULL,NULL,timeout);
+}
+
+uint8_t MAX3421E::ControlRequestStream(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest, uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, PacketConsumer consumer, void* context, uint16_t timeout)
+{
+	if (consumer == NULL || !(bmRequestType & 0x80))
+		return hrBADREQ;
+	
+	return ControlTransfer(address,ep,bmRequestType,bRequest,wValueLow,wValueHigh,wIdx,wLength,NULL,consumer,context,timeout);
+}
+
+uint8_t MAX3421E::ControlTransfer(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest, uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, uint8_t* data, PacketConsumer consumer, void* context, uint16_t timeout)
 {
 	/* Inspired by https://github.com/felis/USB_Host_Shield_2.0 */
 	/* and https://pdfserv.maximintegrated.com/en/an/AN3785.pdf */
@@ -429,6 +1496,12 @@ uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestT
 	uint8_t rcode;
 	SetupPackage setupPkg;
 	
+	// Chip is shared with the asynchronous transfer requests
+	CompleteActiveTransfer();
+	
+	// All stages share one deadline
+	portTickType deadline = xTaskGetTickCount() + timeout;
+	
 	// Set address
 	SetAddress(address);
 	
@@ -442,10 +1515,9 @@ uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestT
 	setupPkg.wIndex			= wIdx;
 	setupPkg.wLength		= wLength;
 	
-	// Load into SUDFIFO
-	WriteMultipleToReg((uint8_t*)&setupPkg, SUDFIFO, 8);	// we can pass SetupPackage directly because the struct is packed
-	
-	rcode = DispatchPacket(SETUP_TOKEN,ep,nakLimit_);	// Dispatch the setup package
+	// Load into SUDFIFO and dispatch the setup package as one job
+	LaunchSetup((uint8_t*)&setupPkg,ep);	// we can pass SetupPackage directly because the struct is packed
+	rcode = FinishPacket(SETUP_TOKEN,ep,nakLimit_,NULL,deadline);
 	
 	if (rcode){
 		LOG_ERROR("Dispatch setup packet rcode: %d.",rcode);
@@ -453,7 +1525,7 @@ uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestT
 	}
 	
 	// If data stage is required
-	if (data != NULL){
+	if (data != NULL || consumer != NULL){
 		
 		// If IN-Transfer
 		if (direction){
@@ -463,7 +1535,7 @@ uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestT
 			
 			// Do InTransfer
 			uint16_t nBytesPtr = wLength;
-			rcode = InTransfer(&ep_,&nBytesPtr,data,1,nakLimit_);	// Toggle errors are handled in InTransfer
+			rcode = ReceivePackets(&ep_,&nBytesPtr,data,consumer,context,1,nakLimit_,deadline);	// Toggle errors are handled in ReceivePackets
 
 			if (rcode){
 				LOG_ERROR("Data stage failed %d", rcode);
@@ -481,78 +1553,172 @@ uint8_t MAX3421E::ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestT
 	}
 	
 	// Status stage - do specific handshake depending on direction
-	return DispatchPacket((direction) ? OUT_HANDSHAKE_TOKEN : IN_HANDSHAKE_TOKEN, ep,nakLimit_);
+	uint8_t token = (direction) ? OUT_HANDSHAKE_TOKEN : IN_HANDSHAKE_TOKEN;
+	LaunchPacket(token,ep);
+	return FinishPacket(token,ep,nakLimit_,NULL,deadline);
 }
 
-uint8_t MAX3421E::OutTransfer(EpInfo* pep, uint8_t nbytes, uint8_t* data,uint8_t naklimit)
+void MAX3421E::LoadSndFifo(uint8_t* data, uint8_t nbytes)
+{
+	// Load data into the free sndfifo and commit it to the SIE (switches to the other one)
+	SerialSegment job[2] = {
+		{REG_WRITE(SNDFIFO), data, NULL, nbytes, 0},
+		{REG_WRITE(SNDBC), &nbytes, NULL, 1, 0}
+	};
+	
+	spi_.Execute(job,2);
+	status_ = job[1].status;
+	
+	STATS_ADD(spiBytes,3 + nbytes);
+}
+
+void MAX3421E::ReloadSndFifo(uint8_t* data, uint8_t nbytes)
+{
+	/* Inspired by https://github.com/felis/USB_Host_Shield_2.0 */
+	uint8_t empty = 0;
+	SerialSegment job[3] = {
+		{REG_WRITE(SNDBC), &empty, NULL, 1, 0},
+		{REG_WRITE(SNDFIFO), data, NULL, nbytes, 0},
+		{REG_WRITE(SNDBC), &nbytes, NULL, 1, 0}
+	};
+	
+	spi_.Execute(job,3);
+	status_ = job[2].status;
+	
+	STATS_ADD(spiBytes,5 + nbytes);
+}
+
+uint8_t MAX3421E::OutTransfer(EpInfo* pep, uint16_t nbytes, uint8_t* data,uint8_t naklimit, uint16_t timeout)
 {
 	uint8_t rcode = 0;
+	uint8_t maxPktSize = pep->maxPktSize;
+	uint16_t sent = 0;		// Bytes acknowledged by the device
+	uint16_t loaded;		// Bytes committed to the sndfifos
+	uint8_t pktSize;		// Size of the packet on the wire
+	uint8_t nextSize = 0;	// Size of the packet waiting in the second sndfifo
+	bool preloaded = false;
 	
-	/* Only supports up to 64 bytes of data for the time being (TODO: should be increased)*/
-	if (nbytes > 64)
+	if (maxPktSize == 0)
 		return hrDATAERROR;
 	
+	// Chip is shared with the asynchronous transfer requests
+	CompleteActiveTransfer();
+	
+	portTickType deadline = xTaskGetTickCount() + timeout;
+	
 	// Set toggle value
-	if (pep->bmRcvToggle) {
-		WriteSingleToReg((1<<RCVTOG1),HCTL);
+	if (pep->bmSndToggle) {
+		WriteSingleToReg((1<<SNDTOG1),HCTL);
 		} else {
-		WriteSingleToReg((1<<RCVTOG0),HCTL);
+		WriteSingleToReg((1<<SNDTOG0),HCTL);
 	}
 	
-	// If sendbuffer is available
-	if (ReadSingleFromReg(HIRQ) & (1<<SNDBAVIRQ)){
+	// If sendbuffer is available (HIRQ was clocked out while writing the toggle)
+	if ((status_ & (1<<SNDBAVIRQ)) == 0)
+		return hrBUFFERFULL;
+	
+	// Load first packet
+	pktSize = (nbytes < maxPktSize) ? nbytes : maxPktSize;
+	LoadSndFifo(data, pktSize);
+	loaded = pktSize;
+	
+	while(1){
+		// Dispatch OUT token to endpoint
+		LaunchPacket(OUT_TOKEN, pep->epAddr);
 		
-		// Buffer is available load data into sndfifo
-		WriteMultipleToReg(data, SNDFIFO, nbytes);
+		/* Fill the second sndfifo while the first packet is on the wire */
+		if (!preloaded && loaded < nbytes && (status_ & (1<<SNDBAVIRQ))){
+			nextSize = (nbytes - loaded < maxPktSize) ? nbytes - loaded : maxPktSize;
+			LoadSndFifo(data + loaded, nextSize);
+			loaded += nextSize;
+			preloaded = true;
+		}
 		
-		// Load number of bytes into SNDBC
-		WriteSingleToReg(nbytes,SNDBC);
+		rcode = FinishPacket(OUT_TOKEN, pep->epAddr, naklimit, pep, deadline, data + sent, pktSize);
 		
-		while(1){
-			// Dispatch OUT token to endpoint
-			rcode = DispatchPacket(OUT_TOKEN, pep->epAddr,naklimit);	// Dispatch IN TOKEN to endpoint
+		// The NAK reload reset the sndfifos, the preloaded packet is loaded again after this one
+		if (sndReloaded_ && preloaded){
+			loaded -= nextSize;
+			preloaded = false;
+		}
 		
-			// If there was a datatoggle issue
-			if (rcode == hrTOGERR){
-					
-				/* TOGERR indicates error on the toggle therefor we check the toggle again */
-				pep->bmRcvToggle = (ReadSingleFromReg(HRSL) & (1<<RCVTOGRD) ? 0 : 1);
-					
-				if (pep->bmRcvToggle){
-					WriteSingleToReg(RCVTOG1,HCTL);
-					} else {
-					WriteSingleToReg(RCVTOG0,HCTL);
-				}
-				continue;
+		// If there was a datatoggle issue
+		if (rcode == hrTOGERR && !DeadlinePassed(deadline)){
+				
+			/* TOGERR indicates error on the toggle therefor we check the toggle again */
+			pep->bmSndToggle = (ReadSingleFromReg(HRSL) & (1<<SNDTOGRD) ? 0 : 1);
+				
+			if (pep->bmSndToggle){
+				WriteSingleToReg((1<<SNDTOG1),HCTL);
+				} else {
+				WriteSingleToReg((1<<SNDTOG0),HCTL);
 			}
+			continue;	// Resend, the SIE keeps the unacknowledged packet
+		}
 		
-			if (rcode != hrSUCCES)
-			{
-				// Something went wrong data might need to be resent!
-				// Examine hrslt bits
-				uint8_t hrslt = ReadSingleFromReg(HRSL) & 0x0F;	// Only examine hrslt bits
-				LOG_ERROR("OutTransfer ERROR: %d",hrslt);
-				return hrDATAERROR;
-			}
-			
-			break;
+		// Endpoint backs off, the NAK'ed packet keeps its toggle for the next call
+		if (rcode == hrNAK){
+			pep->bmSndToggle = (ReadSingleFromReg(HRSL) & (1<<SNDTOGRD) ? 1 : 0);
+			return hrNAK;
 		}
 		
-		return rcode;
+		if (rcode != hrSUCCES)
+		{
+			// Something went wrong data might need to be resent!
+			LOG_ERROR("OutTransfer ERROR: %d",rcode);
+			return hrDATAERROR;
+		}
+		
+		sent += pktSize;
+		
+		if (sent >= nbytes)
+			break;
+		
+		/* Next packet is either waiting in the second sndfifo or has to be loaded now */
+		if (preloaded){
+			pktSize = nextSize;
+			preloaded = false;
+		} else {
+			pktSize = (nbytes - loaded < maxPktSize) ? nbytes - loaded : maxPktSize;
+			LoadSndFifo(data + loaded, pktSize);
+			loaded += pktSize;
+		}
 	}
 	
-	return hrBUFFERFULL;
+	// Save toggle value
+	pep->bmSndToggle = (ReadSingleFromReg(HRSL) & (1<<SNDTOGRD) ? 1 : 0);
+	
+	return rcode;
 }
 
-uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uint8_t bInterval,uint8_t naklimit)
+uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uint8_t bInterval,uint8_t naklimit, uint16_t timeout)
+{
+	return ReceivePackets(pep,nbytesptr,data,NULL,NULL,bInterval,naklimit,xTaskGetTickCount() + timeout);
+}
+
+uint8_t MAX3421E::InTransferStream(EpInfo* pep, uint16_t* nbytesptr, PacketConsumer consumer, void* context, uint8_t naklimit, uint16_t timeout)
+{
+	if (consumer == NULL)
+		return hrBADREQ;
+	
+	return ReceivePackets(pep,nbytesptr,NULL,consumer,context,0,naklimit,xTaskGetTickCount() + timeout);
+}
+
+uint8_t MAX3421E::ReceivePackets(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data, PacketConsumer consumer, void* context, uint8_t bInterval,uint8_t naklimit, portTickType deadline)
 {
 	uint8_t rcode = 0;
 	uint8_t nRecieved;
+	bool launched = false;	// Token for the next packet is already on the wire
+	bool last;
+	portTickType lastFrame = 0;	// Frame the previous packet was polled in, set when its token is launched
 	
 	uint16_t nBytes = *nbytesptr;
 	
 	*nbytesptr = 0;
 	
+	// Chip is shared with the asynchronous transfer requests
+	CompleteActiveTransfer();
+	
 	// Set toggle value
 	if (pep->bmRcvToggle) {
 		WriteSingleToReg((1<<RCVTOG1),HCTL);
@@ -563,18 +1729,25 @@ uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uin
 	// Only exits on break
 	while(1)
 	{
-		rcode = DispatchPacket(IN_TOKEN, pep->epAddr,naklimit);	// Dispatch IN TOKEN to endpoint
+		// Dispatch IN TOKEN to endpoint, unless it was launched while draining the previous packet
+		if (!launched){
+			LaunchPacket(IN_TOKEN, pep->epAddr);
+			lastFrame = xTaskGetTickCount();	// the interval counts from the poll, not from the setup above
+		}
+		launched = false;
+		
+		rcode = FinishPacket(IN_TOKEN, pep->epAddr, naklimit, pep, deadline);
 		
 		// If there was a datatoggle issue
-		if (rcode == hrTOGERR){
+		if (rcode == hrTOGERR && !DeadlinePassed(deadline)){
 			
 			/* TOGERR indicates error on the toggle therefor we check the toggle again */
 			pep->bmRcvToggle = (ReadSingleFromReg(HRSL) & (1<<RCVTOGRD) ? 0 : 1);
 			
 			if (pep->bmRcvToggle){
-				WriteSingleToReg(RCVTOG1,HCTL);
+				WriteSingleToReg((1<<RCVTOG1),HCTL);
 				} else {
-				WriteSingleToReg(RCVTOG0,HCTL);
+				WriteSingleToReg((1<<RCVTOG0),HCTL);
 			}
 			continue;
 		}
@@ -587,18 +1760,35 @@ uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uin
 			break;
 		}
 		
-		// RCVDAVIRQ is asserted if data was recieved without errors
-		if ((ReadSingleFromReg(HIRQ) & (1<<RCVDAVIRQ)) == 0)
+		nRecieved = ReadSingleFromReg(RCVBC);		// Number of recieved bytes
+		
+		// RCVDAVIRQ is asserted if data was recieved without errors (HIRQ was clocked out while reading RCVBC)
+		if ((status_ & (1<<RCVDAVIRQ)) == 0)
 		{
 			//LOG_ERROR("NO RCVDAVIRQ! %d",rcode);
 			rcode = hrRECIEVE_ERROR;	// recieve error
 			break;
 		}
 		
-		nRecieved = ReadSingleFromReg(RCVBC);		// Number of recieved bytes
+		// * If we recieve a package that is less than the max package size this has to be the last transmission (also works if the amount of recieved bytes are 0)
+		// * If we have recieved all the bytes specified we're also done.
+		last = (nRecieved < pep->maxPktSize) || (*nbytesptr + nRecieved >= nBytes);
 		
+		/* The second rcvfifo is free, so get the next packet on the wire before draining this one (bulk only) */
+		if (!last && bInterval == 0){
+			LaunchPacket(IN_TOKEN, pep->epAddr);
+			launched = true;
+		}
+		
+		if (consumer != NULL)
+		{
+			if (nRecieved > USB_MAX_PACKET_SIZE)
+				nRecieved = USB_MAX_PACKET_SIZE;
+			
+			ConsumePacket(nRecieved,consumer,context);
+		}
 		// Check if we have recieved more than we can store in data
-		if (nRecieved <= nBytes - *nbytesptr)
+		else if (nRecieved <= nBytes - *nbytesptr)
 		{
 			ReadMultipleFromReg(data+*nbytesptr,RCVFIFO,nRecieved);		// read full package size
 		} else {
@@ -612,9 +1802,7 @@ uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uin
 		WriteSingleToReg((1<<RCVDAVIRQ),HIRQ);		// Clear the IRQ & free the buffer
 		*nbytesptr += nRecieved;					// add this packet's byte count to total transfer length
 		
-		// * If we recieve a package that is less than the max package size this has to be the last transmission (also works if the amount of recieved bytes are 0)
-		// * If we have recieved all the bytes specified we're also done.
-		if ((nRecieved < pep->maxPktSize) || (*nbytesptr >= nBytes))
+		if (last)
 		{
 			// Save toggle value
 			pep->bmRcvToggle = (ReadSingleFromReg(HRSL) & (1<<RCVTOGRD) ? 1 : 0);
@@ -622,53 +1810,57 @@ uint8_t MAX3421E::InTransfer(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data,uin
 			
 			break;
 		} else if (bInterval > 0) {
-			/* If the device has a certain polling interval we must adhere to this */
-			while (0 < bInterval){
-				_delay_ms(1);
-				bInterval--;
-			}
+			/* If the device has a certain polling interval we must adhere to this. Yield until the next eligible
+			   frame (one tick per frame) so other tasks run, and keep the cadence relative to the previous poll */
+			vTaskDelayUntil(&lastFrame,(portTickType)bInterval / portTICK_RATE_MS);
 		}
 		
 	}
 	return rcode;
 }
 
+void MAX3421E::ConsumePacket(uint8_t nbytes, PacketConsumer consumer, void* context)
+{
+	uint8_t packet[USB_MAX_PACKET_SIZE];
+	
+	ReadMultipleFromReg(packet,RCVFIFO,nbytes);
+	consumer(packet,nbytes,context);
+}
+
 void MAX3421E::SetAddress(uint8_t address)
 {
 		
-	WriteSingleToReg(address,PERADDR);			// Load address in PERADDR register
-	uint8_t mode = ReadSingleFromReg(MODE);		// Read current mode
+	WriteShadowedReg(address,PERADDR);			// Load address in PERADDR register (skipped if unchanged)
+	uint8_t mode = ReadShadowedReg(MODE);		// Current mode comes from the shadow
 	
 	// Set bmLOWSPEED and bmHUBPRE in case of low-speed device, reset them otherwise
-	WriteSingleToReg((usb_->lowspeed) ? mode | (1<<LOWSPEED) | (1<<HUBPRE) : mode & ~((1<<LOWSPEED) | (1<<HUBPRE)),MODE);
+	WriteShadowedReg((usb_->lowspeed) ? mode | (1<<LOWSPEED) | (1<<HUBPRE) : mode & ~((1<<LOWSPEED) | (1<<HUBPRE)),MODE);
 
 }
 
-bool MAX3421E::Reset()
+bool MAX3421E::Reset(uint16_t timeout)
 {
-	uint8_t timeout = 1;
+	uint16_t elapsed;
 	
 	// do chip reset
-	WriteSingleToReg((1<<CHIPRES),USBCTL);		// Chip reset
-	WriteSingleToReg(0x00,USBCTL);				// Clear register (chip reset and powerdown)
+	RunScript(chipResetScript,SCRIPT_LENGTH(chipResetScript));
+	InvalidateShadow();							// Registers are back at their reset values
 	
-	while(timeout++){
+	for (elapsed = 0; elapsed < timeout; elapsed++){
 		
 		/* wait for internal oscillator to be stable */
 		if(ReadSingleFromReg(USBIRQ) & (1<<OSCOKIRQ))
-			break;
+			return true;
 		
-		_delay_ms(1);	// wait 255 ms before asserting timeout
+		_delay_ms(1);	// the scheduler isn't running yet, so there are no ticks to measure against
 	}
 	
-	return (bool)timeout;
+	return false;
 }
 
 // default destructor
 MAX3421E::~MAX3421E()
 {
-	delete spi_;
-	
 	for (int i = 0; i < sizeof(devRecord_)/sizeof(devRecord_[0]); i++)
 		delete[] devRecord_[0].devDescriptor;
 		
@@ -0,0 +1,220 @@
+/*
+ * TransferScheduler.cpp
+ *
+ * Created: 17/10/2026 13.07.44
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */ 
+
+#include "TransferScheduler.hpp"
+#include <stddef.h>
+#include "task.h"
+
+TransferScheduler::TransferScheduler(MAX3421E* max)
+{
+	max_ = max;
+	
+	controlHead_	= NULL;
+	controlTail_	= NULL;
+	bulkHead_		= NULL;
+	bulkTail_		= NULL;
+	deferredHead_	= NULL;
+	deferredTail_	= NULL;
+	
+	for (int i = 0; i < MAX_PERIODIC_TRANSFERS; i++)
+		periodic_[i].request = NULL;
+}
+
+bool TransferScheduler::AddPeriodicTransfer(TransferRequest* request, uint8_t interval)
+{
+	for (int i = 0; i < MAX_PERIODIC_TRANSFERS; i++){
+		if (periodic_[i].request == NULL){
+			periodic_[i].interval	= (interval > 0) ? interval : 1;
+			periodic_[i].nextFrame	= xTaskGetTickCount();	// due right away
+			periodic_[i].request	= request;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void TransferScheduler::RemovePeriodicTransfer(TransferRequest* request)
+{
+	for (int i = 0; i < MAX_PERIODIC_TRANSFERS; i++)
+		if (periodic_[i].request == request)
+			periodic_[i].request = NULL;
+}
+
+bool TransferScheduler::QueueTransfer(TransferRequest* request)
+{
+	if (request == NULL || request->ep == NULL)
+		return false;
+	
+	// Device configs queue from other tasks, the check and the queueing must not interleave
+	portENTER_CRITICAL();
+	
+	if (IsBusy(request)){
+		portEXIT_CRITICAL();
+		return false;
+	}
+	
+	request->state = URB_SCHEDULED;
+	
+	if (request->token == SETUP_TOKEN)
+		Push(&controlHead_,&controlTail_,request);
+	else
+		Push(&bulkHead_,&bulkTail_,request);
+	
+	portEXIT_CRITICAL();
+	
+	return true;
+}
+
+void TransferScheduler::Schedule()
+{
+	/* Only one request on the wire at a time, so a due periodic transfer never waits behind a queue of OUT packets */
+	if (max_->TransfersPending()){
+		Service(max_->Budget(USB_XFER_IRQ_TIMEOUT));
+		return;
+	}
+	
+	portTickType frame = xTaskGetTickCount();	// One tick per 1 ms frame
+	
+	/* Periodic transfers first, the most overdue one wins */
+	PeriodicTransfer* due = NULL;
+	portTickType dueLate = 0;
+	
+	for (int i = 0; i < MAX_PERIODIC_TRANSFERS; i++){
+		PeriodicTransfer* p = &periodic_[i];
+		
+		if (p->request == NULL || IsBusy(p->request))
+			continue;
+		
+		portTickType late = frame - p->nextFrame;
+		if (late > portMAX_DELAY / 2)		// not due yet (difference wrapped)
+			continue;
+		
+		if (due == NULL || late > dueLate){
+			due = p;
+			dueLate = late;
+		}
+	}
+	
+	TransferRequest* request = NULL;
+	
+	if (due != NULL){
+		due->nextFrame = frame + due->interval;
+		request = due->request;
+	} else {
+		/* Then NAK'ed requests that are due again, then control, then background bulk and OUT traffic */
+		request = PopDeferred(frame);
+		if (request == NULL)
+			request = Pop(&controlHead_,&controlTail_);
+		if (request == NULL)
+			request = Pop(&bulkHead_,&bulkTail_);
+	}
+	
+	if (request != NULL){
+		if (max_->SubmitTransfer(request)){
+			Service(0);	// get the token on the wire right away
+		} else if (request->state == URB_SCHEDULED || request->state == URB_BACKOFF){
+			// Still ours and the chip won't take it, end it instead of losing it in URB_SCHEDULED
+			request->rcode = hrBADREQ;
+			request->state = URB_DONE;
+			if (request->callback != NULL)
+				request->callback(request,request->context);
+		}
+		return;
+	}
+	
+	/* Nothing due in this frame, under a budget of 0 the caller sleeps between rounds instead */
+	if (max_->Budget(1) > 0)
+		vTaskDelay(1);
+}
+
+void TransferScheduler::Clear()
+{
+	for (int i = 0; i < MAX_PERIODIC_TRANSFERS; i++)
+		periodic_[i].request = NULL;
+	
+	TransferRequest* request;
+	while ((request = Pop(&controlHead_,&controlTail_)) != NULL)
+		request->state = URB_IDLE;
+	while ((request = Pop(&bulkHead_,&bulkTail_)) != NULL)
+		request->state = URB_IDLE;
+	while ((request = Pop(&deferredHead_,&deferredTail_)) != NULL)
+		request->state = URB_IDLE;
+}
+
+void TransferScheduler::Push(TransferRequest** head, TransferRequest** tail, TransferRequest* request)
+{
+	request->next = NULL;
+	
+	// Other tasks may queue while the USB task schedules
+	portENTER_CRITICAL();
+	if (*tail == NULL)
+		*head = request;
+	else
+		(*tail)->next = request;
+	*tail = request;
+	portEXIT_CRITICAL();
+}
+
+TransferRequest* TransferScheduler::Pop(TransferRequest** head, TransferRequest** tail)
+{
+	portENTER_CRITICAL();
+	TransferRequest* request = *head;
+	if (request != NULL){
+		*head = request->next;
+		if (*head == NULL)
+			*tail = NULL;
+		request->next = NULL;
+	}
+	portEXIT_CRITICAL();
+	
+	return request;
+}
+
+void TransferScheduler::Service(portTickType wait)
+{
+	max_->ServiceTransfers(wait);
+	
+	/* A NAK'ed request backs off here, so due periodic transfers aren't stuck behind it */
+	TransferRequest* deferred = max_->TakeDeferredTransfer();
+	if (deferred != NULL)
+		Push(&deferredHead_,&deferredTail_,deferred);
+}
+
+TransferRequest* TransferScheduler::PopDeferred(portTickType frame)
+{
+	TransferRequest* due = NULL;
+	TransferRequest* duePrev = NULL;
+	portTickType dueLate = 0;
+	TransferRequest* prev = NULL;
+	
+	for (TransferRequest* request = deferredHead_; request != NULL; prev = request, request = request->next){
+		portTickType late = frame - request->retryTick;
+		if (late > portMAX_DELAY / 2)		// not due yet (difference wrapped)
+			continue;
+		
+		if (due == NULL || late > dueLate){
+			due = request;
+			duePrev = prev;
+			dueLate = late;
+		}
+	}
+	
+	if (due == NULL)
+		return NULL;
+	
+	// Only the USB task touches this list
+	if (duePrev == NULL)
+		deferredHead_ = due->next;
+	else
+		duePrev->next = due->next;
+	if (deferredTail_ == due)
+		deferredTail_ = duePrev;
+	due->next = NULL;
+	
+	return due;
+}
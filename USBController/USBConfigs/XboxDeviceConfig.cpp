@@ -13,14 +13,18 @@
 #include "XboxDeviceConfig.hpp"
 #include "Logger.hpp"
 #include <stdlib.h>
+#include <string.h>
 
 #include "task.h"
 
 #include "xboxdefs.hpp"
+#include "DescriptorCache.hpp"
+#include "ConfigDescriptorParser.hpp"
 
-XboxDeviceConfig::XboxDeviceConfig(MAX3421E* max){
+XboxDeviceConfig::XboxDeviceConfig(MAX3421E* max, TransferScheduler* scheduler){
 	
 	max_ = max;
+	scheduler_ = scheduler;
 	nCallbackFunctions_ = 0;
 	nCallbackContexts_ = 0;
 	
@@ -31,16 +35,13 @@ XboxDeviceConfig::XboxDeviceConfig(MAX3421E* max){
 	vSemaphoreCreateBinary(rumbleSemaphore_);
 	vSemaphoreCreateBinary(ledSemaphore_);
 	
-	/* Hardcode endpoints based on external analysis */
-	inputEndpoint_.Interval = 4;
-	inputEndpoint_.maxPktSize = 32;
-	inputEndpoint_.epAddr = 1;
-	inputEndpoint_.direction = 1;
+	ResetEndpoints();
 	
-	outputEndpoint_.Interval = 8;
-	outputEndpoint_.maxPktSize = 32;
-	outputEndpoint_.epAddr = 1;
-	outputEndpoint_.direction = 0;
+	devAddress_ = 0;
+	ledRequest_.state = URB_IDLE;
+	inputRequest_.state = URB_IDLE;
+	rumbleRequest_.state = URB_IDLE;
+	rumbleStopPending_ = false;
 
 	/* Null initialize all callback functions */
 	for (int i = 0; i < MAX_CALLBACK_FUNCTIONS; i++){
@@ -61,8 +62,9 @@ uint16_t XboxDeviceConfig::GetPid()
 
 void XboxDeviceConfig::Process()
 {
-	PollInputs();
+	/* Inputs are polled by the scheduler, only output requests are handled here */
 	PollRumbleRequest();
+	StopRumble();
 	PollLEDRequest();
 }
 
@@ -115,17 +117,34 @@ void XboxDeviceConfig::RequestLED(uint8_t ledAnimation)
 
 void XboxDeviceConfig::DoLEDAnimation()
 {
+	/* Previous animation is still being sent */
+	if (TransferScheduler::IsBusy(&ledRequest_))
+		return;
+	
 	/* Parameters are used to determine the LED animation */
-	uint8_t ledPacket[] = { LED_TYPE, 0x03, ledAnimation_};
-		
-	/* Transfer LED packet */
-	uint8_t rcode = max_->OutTransfer(&outputEndpoint_,sizeof(ledPacket) / sizeof(ledPacket[0]),ledPacket,0);
+	ledPacket_[0] = LED_TYPE;
+	ledPacket_[1] = 0x03;
+	ledPacket_[2] = ledAnimation_;
+	
+	/* Queue LED packet, it's sent while we go on polling inputs */
+	ledRequest_.ep			= &outputEndpoint_;
+	ledRequest_.address		= devAddress_;
+	ledRequest_.token		= OUT_TOKEN;
+	ledRequest_.setup		= NULL;
+	ledRequest_.data		= ledPacket_;
+	ledRequest_.length		= sizeof(ledPacket_);
+	ledRequest_.naklimit	= 8;
+	ledRequest_.callback	= OutputDoneWrapper;
+	ledRequest_.context		= this;
+	
+	scheduler_->QueueTransfer(&ledRequest_);
+}
 
-	if (rcode){
-		LOG_ERROR("Rcode: %d",rcode);
-		return;
+void XboxDeviceConfig::OutputDoneWrapper(TransferRequest* request, void* context)
+{
+	if (request->rcode){
+		LOG_ERROR("Rcode: %d",request->rcode);
 	}
-	
 }
 
 /* Checks if there has been any requests regarding rumble */
@@ -133,7 +152,8 @@ void XboxDeviceConfig::PollRumbleRequest()
 {
 	xSemaphoreTake(rumbleSemaphore_,portMAX_DELAY);
 	
-	if (rumble_){
+	/* Wait with new rumble packets till the previous one is sent */
+	if (rumble_ && !TransferScheduler::IsBusy(&rumbleRequest_)){
 		DoRumbleController();
 		
 		/* Reset activation variables */
@@ -158,52 +178,85 @@ void XboxDeviceConfig::DoRumbleController()
 {
 	/* Parameters are used to determine the motorspeed for the two rumble motors in the controller */
 	uint8_t rumblePacket[] = { RUMBLE_TYPE, 0x08, 0x00, leftRumble_, rightRumble_, 0x00, 0x00, 0x00 };
-		
-	/* Transfer rumble packet */
-	uint8_t rcode = max_->OutTransfer(&outputEndpoint_,sizeof(rumblePacket) / sizeof(rumblePacket[0]),rumblePacket,0);
+	memcpy(rumblePacket_,rumblePacket,sizeof(rumblePacket_));
+	
+	/* Queue rumble packet as background traffic */
+	rumbleRequest_.ep			= &outputEndpoint_;
+	rumbleRequest_.address		= devAddress_;
+	rumbleRequest_.token		= OUT_TOKEN;
+	rumbleRequest_.setup		= NULL;
+	rumbleRequest_.data			= rumblePacket_;
+	rumbleRequest_.length		= sizeof(rumblePacket_);
+	rumbleRequest_.naklimit		= 8;
+	rumbleRequest_.callback		= OutputDoneWrapper;
+	rumbleRequest_.context		= this;
+	
+	if (!scheduler_->QueueTransfer(&rumbleRequest_))
+		return;
+	
+	/* Reset rumble packet is sent from StopRumble, so the USB task doesn't sleep meanwhile */
+	rumbleStopTick_		= xTaskGetTickCount() + RUMBLE_DURATION/portTICK_RATE_MS;
+	rumbleStopPending_	= true;
+}
 
-	if (rcode){
-		LOG_ERROR("Rcode: %d",rcode);
+void XboxDeviceConfig::StopRumble()
+{
+	if (!rumbleStopPending_ || TransferScheduler::IsBusy(&rumbleRequest_))
+		return;
+	
+	/* Not time yet (difference wrapped) */
+	if ((portTickType)(xTaskGetTickCount() - rumbleStopTick_) > portMAX_DELAY / 2)
 		return;
-	}
 	
 	/* Transfer reset rumble packet */
-	vTaskDelay(200/portTICK_RATE_MS);
 	uint8_t resetRumblePacket[] = { RUMBLE_TYPE, 0x08, 0x00, 0, 0, 0x00, 0x00, 0x00 };
-	rcode = max_->OutTransfer(&outputEndpoint_,sizeof(resetRumblePacket) / sizeof(resetRumblePacket[0]),resetRumblePacket,0);
-
-	if (rcode){
-		LOG_ERROR("Rcode: %d",rcode);
-		return;
-	}
-		
+	memcpy(rumblePacket_,resetRumblePacket,sizeof(rumblePacket_));
+	
+	if (scheduler_->QueueTransfer(&rumbleRequest_))
+		rumbleStopPending_ = false;
 }
 
 void XboxDeviceConfig::PollInputs()
 {
-	uint8_t fullPacket[64];	// Always transfers two packets so store both to save calling this method two times
-	uint16_t nbytes = 64;
-	
-	/* Always transfers two packets */
-	uint8_t rcode = max_->InTransfer(&inputEndpoint_,&nbytes,(uint8_t*)&fullPacket,inputEndpoint_.Interval,1);
+	inputRequest_.ep		= &inputEndpoint_;
+	inputRequest_.address	= devAddress_;
+	inputRequest_.token		= IN_TOKEN;
+	inputRequest_.setup		= NULL;
+	inputRequest_.data		= inputPacket_;
+	inputRequest_.length	= sizeof(inputPacket_);
+	inputRequest_.naklimit	= 0;	// NAK means no new information, try again next interval
+	inputRequest_.callback	= InputDoneWrapper;
+	inputRequest_.context	= this;
 	
-	if (rcode == hrNAK)
+	/* Periodic input has priority over the output packets */
+	scheduler_->RemovePeriodicTransfer(&inputRequest_);
+	scheduler_->AddPeriodicTransfer(&inputRequest_,inputEndpoint_.Interval);
+}
+
+void XboxDeviceConfig::InputDoneWrapper(TransferRequest* request, void* context)
+{
+	static_cast<XboxDeviceConfig*>(context)->HandleInput(request);
+}
+
+void XboxDeviceConfig::HandleInput(TransferRequest* request)
+{
+	if (request->rcode == hrNAK)
 	{
 		/* No interrupts pending = no new information */
 		return;
 	}
 	
-	if (rcode==hrSUCCES)
+	if (request->rcode==hrSUCCES)
 	{
 		/* Ignore packets that doesnt concern control key changes */
-		if (fullPacket[PRIMARY_CONTROLKEYS_OFFSET] == inputRecord_.primaryKeys 
-			&& fullPacket[SECONDARY_CONTROLKEYS_OFFSET] == inputRecord_.secondaryKeys)
+		if (inputPacket_[PRIMARY_CONTROLKEYS_OFFSET] == inputRecord_.primaryKeys 
+			&& inputPacket_[SECONDARY_CONTROLKEYS_OFFSET] == inputRecord_.secondaryKeys)
 			return;
 		
 		
-		/* Update input structure - using only the first packet (we are not concerned about the keys being released) */
-		inputRecord_.primaryKeys	= fullPacket[PRIMARY_CONTROLKEYS_OFFSET];
-		inputRecord_.secondaryKeys	= fullPacket[SECONDARY_CONTROLKEYS_OFFSET];
+		/* Update input structure (we are not concerned about the keys being released) */
+		inputRecord_.primaryKeys	= inputPacket_[PRIMARY_CONTROLKEYS_OFFSET];
+		inputRecord_.secondaryKeys	= inputPacket_[SECONDARY_CONTROLKEYS_OFFSET];
 		
 		// Call callback functions
 		for (int i = 0; i < MAX_CALLBACK_FUNCTIONS; i++){
@@ -211,11 +264,6 @@ void XboxDeviceConfig::PollInputs()
 				callbackFunctions_[i](&inputRecord_,callbackContexts_[i]);
 			}
 		}
-		
-		/*if (inputRecord_.primaryKeys & AKEY){
-			uint8_t rumbles[] = {255,255};
-			OutputRequest(REQUEST_RUMBLE,rumbles);
-		}*/
 	}
 
 }
@@ -232,39 +280,179 @@ void XboxDeviceConfig::FlushInput()
 
 bool XboxDeviceConfig::Configure(const DeviceRecord* record)
 {
+	devAddress_ = record->devAddress;
+	
+	const USB_DEVICE_DESCRIPTOR* desc = record->devDescriptor;
+	CachedConfig cached;
+	
+	/* Known controller, it's unconfigured after the bus reset so only SetConfiguration is needed */
+	if (DescriptorCache::Find(desc->idVendor,desc->idProduct,desc->bcdDevice,&cached)){
+		if (max_->SetConfiguration(record->devAddress,0,cached.bConfigurationValue) == hrSUCCES){
+			LoadCachedEndpoints(&cached);
+			FlushInput();
+			PollInputs();
+			LOG_DEBUG("Configured device from cache.");
+			return true;
+		}
+		
+		DescriptorCache::Invalidate(desc->idVendor,desc->idProduct,desc->bcdDevice);	// rejected, read it again
+	}
+	
 	/* Check if device is already configured */
 	uint8_t byte = 0xff;
 	uint8_t rcode = max_->GetConfiguration(record->devAddress,0,1,&byte);
 	
 	if (rcode == hrSUCCES){
-		if (byte != 0)
+		if (byte != 0){
+			PollInputs();	// Start polling inputs
 			return true;
+		}
 	}
 	
-	/* Get configuration descriptor - we need the configValue to enable the device*/
-	uint8_t config_desc[sizeof(USB_CONFIGURATION_DESCRIPTOR)];
-	USB_CONFIGURATION_DESCRIPTOR* configPtr = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>(config_desc);
+	/* Walk the whole configuration descriptor - we need the configValue to enable the device and the gamepad endpoints */
+	ConfigDescriptorParser parser;
 	
-	rcode = max_->GetConfigDescriptor(record->devAddress, 0, sizeof(USB_CONFIGURATION_DESCRIPTOR), (uint8_t*)&config_desc);
+	rcode = parser.Read(max_,record->devAddress);
 
 	if (rcode != hrSUCCES) return false;
 	
+	LoadParsedEndpoints(&parser);
+	
 	/* Enable configuration */
 	LOG_DEBUG("Enabling configuration.");
 	
-	rcode = max_->SetConfiguration(record->devAddress,0,configPtr->bConfigurationValue);
+	rcode = max_->SetConfiguration(record->devAddress,0,parser.GetConfigurationValue());
 	
 	if (rcode != hrSUCCES) return false;
 	
 	vTaskDelay(100/portTICK_RATE_MS);
 	
 	FlushInput();	// Flush input
+	PollInputs();	// Start polling inputs
+	
+	/* Remember the configuration, the next plug-in skips the descriptor requests and the delay */
+	cached.idVendor				= desc->idVendor;
+	cached.idProduct			= desc->idProduct;
+	cached.bcdDevice			= desc->bcdDevice;
+	cached.bConfigurationValue	= parser.GetConfigurationValue();
+	StoreCachedEndpoints(&cached);
+	DescriptorCache::Store(&cached);
 	
 	LOG_DEBUG("Succesfully configured device!");
 	
 	return true;
 }
 
+void XboxDeviceConfig::LoadParsedEndpoints(const ConfigDescriptorParser* parser)
+{
+	const ParsedInterface* gamepad = parser->FindInterface(XBOX_INTERFACE_CLASS,XBOX_INTERFACE_SUBCLASS,XBOX_INTERFACE_PROTOCOL);
+	const ParsedEndpoint* in = ConfigDescriptorParser::FindEndpoint(gamepad,true,USB_TRANSFER_TYPE_INTERRUPT);
+	const ParsedEndpoint* out = ConfigDescriptorParser::FindEndpoint(gamepad,false,USB_TRANSFER_TYPE_INTERRUPT);
+	
+	if (in == NULL || out == NULL){
+		LOG_ERROR("No gamepad endpoints found, using defaults.");
+		return;
+	}
+	
+	inputEndpoint_.epAddr		= in->bEndpointAddress & 0x0F;
+	inputEndpoint_.maxPktSize	= in->maxPktSize;
+	inputEndpoint_.Interval		= in->bInterval;
+	
+	outputEndpoint_.epAddr		= out->bEndpointAddress & 0x0F;
+	outputEndpoint_.maxPktSize	= out->maxPktSize;
+	outputEndpoint_.Interval	= out->bInterval;
+}
+
+void XboxDeviceConfig::StoreCachedEndpoints(CachedConfig* cached)
+{
+	const EpInfo* endpoints[] = {&inputEndpoint_, &outputEndpoint_};
+	
+	cached->numEndpoints = sizeof(endpoints)/sizeof(endpoints[0]);
+	
+	for (uint8_t i = 0; i < cached->numEndpoints; i++){
+		cached->endpoints[i].epAddr		= endpoints[i]->epAddr;
+		cached->endpoints[i].maxPktSize	= endpoints[i]->maxPktSize;
+		cached->endpoints[i].direction	= endpoints[i]->direction;
+		cached->endpoints[i].Interval	= endpoints[i]->Interval;
+	}
+}
+
+void XboxDeviceConfig::LoadCachedEndpoints(const CachedConfig* cached)
+{
+	EpInfo* endpoints[] = {&inputEndpoint_, &outputEndpoint_};
+	
+	for (uint8_t i = 0; i < cached->numEndpoints && i < sizeof(endpoints)/sizeof(endpoints[0]); i++){
+		endpoints[i]->epAddr		= cached->endpoints[i].epAddr;
+		endpoints[i]->maxPktSize	= cached->endpoints[i].maxPktSize;
+		endpoints[i]->direction		= cached->endpoints[i].direction;
+		endpoints[i]->Interval		= cached->endpoints[i].Interval;
+	}
+}
+
+void XboxDeviceConfig::ResetEndpoints()
+{
+	/* Defaults based on external analysis, replaced by the endpoints found in the configuration descriptor */
+	inputEndpoint_.Interval = 4;
+	inputEndpoint_.maxPktSize = 32;
+	inputEndpoint_.epAddr = 1;
+	inputEndpoint_.direction = 1;
+	inputEndpoint_.bmSndToggle = 0;
+	inputEndpoint_.bmRcvToggle = 0;
+	
+	outputEndpoint_.Interval = 8;
+	outputEndpoint_.maxPktSize = 32;
+	outputEndpoint_.epAddr = 1;
+	outputEndpoint_.direction = 0;
+	outputEndpoint_.bmSndToggle = 0;
+	outputEndpoint_.bmRcvToggle = 0;
+	
+	/* No input pending is answered with a NAK, the scheduler polls again next interval */
+	inputEndpoint_.nakPolicy	= NAK_POLICY_LIMIT;
+	inputEndpoint_.bmNakPower	= 0;
+	inputEndpoint_.nakFrames	= 0;
+	inputEndpoint_.nakCount		= 0;
+	inputEndpoint_.nakGiveUps	= 0;
+	
+	/* Output packets are retried with back-off (1..8 frames) for up to 8 NAKs */
+	outputEndpoint_.nakPolicy	= NAK_POLICY_BACKOFF;
+	outputEndpoint_.bmNakPower	= 3;
+	outputEndpoint_.nakFrames	= 0;
+	outputEndpoint_.nakCount	= 0;
+	outputEndpoint_.nakGiveUps	= 0;
+}
+
+void XboxDeviceConfig::Release()
+{
+	/* Transfers were dropped by USBHost, so the requests are free again */
+	ledRequest_.state		= URB_IDLE;
+	inputRequest_.state		= URB_IDLE;
+	rumbleRequest_.state	= URB_IDLE;
+	rumbleStopPending_		= false;
+	devAddress_				= 0;
+	
+	/* The next controller starts from DATA0 and the default layout until its descriptors are read */
+	ResetEndpoints();
+	
+	/* Requests for the old controller are dropped */
+	xSemaphoreTake(rumbleSemaphore_,portMAX_DELAY);
+	rumble_ = false;
+	xSemaphoreGive(rumbleSemaphore_);
+	
+	xSemaphoreTake(ledSemaphore_,portMAX_DELAY);
+	led_ = false;
+	xSemaphoreGive(ledSemaphore_);
+	
+	inputRecord_.primaryKeys	= 0;
+	inputRecord_.secondaryKeys	= 0;
+	
+	nCallbackFunctions_ = 0;
+	nCallbackContexts_ = 0;
+	for (int i = 0; i < MAX_CALLBACK_FUNCTIONS; i++){
+		callbackFunctions_[i] = NULL;
+		callbackContexts_[i] = NULL;
+	}
+}
+
 void XboxDeviceConfig::AddCallback(CallbackFunction callback, void* context)
 {
 	if (nCallbackFunctions_ < MAX_CALLBACK_FUNCTIONS)
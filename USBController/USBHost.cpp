@@ -13,7 +13,7 @@
 #include "XboxDeviceConfig.hpp"
 
 // default constructor
-USBHost::USBHost()
+USBHost::USBHost(volatile uint8_t* csPort, uint8_t csPin, uint8_t intLine) : max_(csPort,csPin,intLine), scheduler_(&max_)
 {
 	Initialize();
 	state_ = HOST_DISCONNECTED;	// setup state machine
@@ -54,7 +54,7 @@ bool USBHost::Initialize()
 	max_.Initialize();
 	
 	/* Add supported USB devices */
-	AddDeviceConfig(new XboxDeviceConfig(&max_));
+	AddDeviceConfig(new XboxDeviceConfig(&max_,&scheduler_));
 	
 	/* Null initialize all callback functions in queue */
 	nCallbackFunctionsQueue_ = 0;
@@ -70,6 +70,12 @@ bool USBHost::Initialize()
 
 void USBHost::Process()
 {
+	max_.MonitorClock();	// Rate limited, steps the SPI clock down on read-back errors
+	
+#ifdef MAX3421E_SHADOW_CHECK
+	max_.CheckShadow();		// Rate limited, only reads the chip every SHADOW_CHECK_INTERVAL ms
+#endif
+	
 	switch (state_){
 		
 		case(HOST_DISCONNECTED):
@@ -122,13 +128,30 @@ void USBHost::Process()
 			assert(activeConfig_ != NULL);
 			
 			activeConfig_->Process();
-			// TODO: Should enumerate here to make sure the device hasn't disconnected
+			scheduler_.Schedule();		// Periodic inputs first, then control and bulk queues
+			
+			/* Back to enumeration if the device was unplugged or stopped answering */
+			if (max_.CheckDisconnect())
+				ReleaseDevice();
 			break;
 		}
 	}
 	 
 }
 
+void USBHost::ReleaseDevice()
+{
+	scheduler_.Clear();
+	max_.CancelTransfers();
+	
+	if (activeConfig_ != NULL)
+		activeConfig_->Release();
+	
+	activeConfig_ = NULL;
+	currentRecord_ = NULL;
+	state_ = HOST_DISCONNECTED;
+}
+
 IDeviceConfig* USBHost::FindMatchingCfg(uint16_t vid, uint16_t pid)
 {
 	/* Loop through added devices */
@@ -0,0 +1,112 @@
+/*
+ * ConfigDescriptorParser.h
+ *
+ * Created: 17/10/2026 16.02.37
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+
+#ifndef CONFIGDESCRIPTORPARSER_H_
+#define CONFIGDESCRIPTORPARSER_H_
+
+#include "MAX3421E.hpp"
+#include "usbdefs.hpp"
+
+#define CONFIG_PARSER_INTERFACES	4	// Interfaces kept per configuration (alternate setting 0 only)
+#define CONFIG_PARSER_ENDPOINTS		2	// Endpoints kept per interface, the parser lives on the task stack
+#define CONFIG_PARSER_BUFFER		9	// Longest descriptor we look into (configuration and interface)
+
+typedef struct ParsedEndpoint {
+	uint8_t bEndpointAddress;		// Endpoint number, bit 7 set for IN endpoints
+	uint8_t bmAttributes;			// Transfer type in bits 1..0
+	uint8_t maxPktSize;				// Low byte of wMaxPacketSize (at most 64 at full speed)
+	uint8_t bInterval;
+} __attribute__((packed)) ParsedEndpoint;
+
+typedef struct ParsedInterface {
+	uint8_t bInterfaceNumber;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t numEndpoints;			// Used entries in endpoints
+	ParsedEndpoint endpoints[CONFIG_PARSER_ENDPOINTS];
+} __attribute__((packed)) ParsedInterface;
+
+/* Walks a configuration descriptor set as it arrives, only the current descriptor's first bytes are buffered */
+class ConfigDescriptorParser
+{
+
+public:
+	ConfigDescriptorParser();
+
+	/**
+	*	Reads the configuration header to learn wTotalLength, then streams the full descriptor set through the parser.
+	*	@param max			Chip the device is attached to.
+	*	@param addr			Device address.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h, hrDATAERROR if the set was malformed.
+	*/
+	uint8_t Read(MAX3421E* max, uint8_t addr);
+
+	/**
+	*	Clears the tables, so a new descriptor set can be parsed.
+	*/
+	void Reset();
+
+	/**
+	*	Feeds the next bytes of the descriptor set, they can be split anywhere.
+	*	@param data		Bytes received.
+	*	@param len		Number of bytes.
+	*/
+	void Parse(const uint8_t* data, uint8_t len);
+
+	/**
+	*	PacketConsumer feeding a parser, pass the parser as context.
+	*/
+	static void Consume(uint8_t* packet, uint8_t len, void* context);
+
+	/**
+	*	Gets whether wTotalLength bytes of well formed descriptors have been parsed.
+	*	@return True if the tables are complete.
+	*/
+	bool IsComplete() const {return !malformed_ && totalLength_ != 0 && received_ == totalLength_ && offset_ == 0;};
+
+	/**
+	*	Finds the first interface of a class, subclass and protocol.
+	*	@return The interface, NULL if the configuration has none.
+	*/
+	const ParsedInterface* FindInterface(uint8_t interfaceClass, uint8_t subClass, uint8_t protocol) const;
+
+	/**
+	*	Finds an endpoint of an interface by direction and transfer type.
+	*	@param interface	Interface to search.
+	*	@param in			True for an IN endpoint, false for OUT.
+	*	@param type			Transfer type (USB_TRANSFER_TYPE_*).
+	*	@return The endpoint, NULL if the interface has none.
+	*/
+	static const ParsedEndpoint* FindEndpoint(const ParsedInterface* interface, bool in, uint8_t type);
+
+	uint8_t GetConfigurationValue() const {return configValue_;};
+	uint8_t GetInterfaceCount() const {return numInterfaces_;};
+	const ParsedInterface* GetInterface(uint8_t index) const {return (index < numInterfaces_) ? &interfaces_[index] : NULL;};
+
+private:
+	/**
+	*	Handles a complete descriptor in buffer_.
+	*/
+	void ParseDescriptor();
+
+	uint8_t buffer_[CONFIG_PARSER_BUFFER];	// First bytes of the current descriptor
+	uint8_t length_;			// bLength of the current descriptor
+	uint8_t offset_;			// Bytes of the current descriptor seen so far
+	uint16_t received_;			// Bytes of the set seen so far
+	uint16_t totalLength_;		// wTotalLength, 0 until the configuration descriptor is parsed
+	bool malformed_;
+
+	uint8_t configValue_;
+	uint8_t numInterfaces_;
+	ParsedInterface interfaces_[CONFIG_PARSER_INTERFACES];
+	ParsedInterface* current_;	// Interface endpoints belong to, NULL while skipping an alternate setting
+};
+
+
+#endif /* CONFIGDESCRIPTORPARSER_H_ */
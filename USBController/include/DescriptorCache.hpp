@@ -0,0 +1,81 @@
+/*
+ * DescriptorCache.h
+ *
+ * Created: 17/10/2026 15.21.08
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */
+
+
+#ifndef DESCRIPTORCACHE_H_
+#define DESCRIPTORCACHE_H_
+
+#include <stdint.h>
+
+#define DESCRIPTOR_CACHE_SLOTS		4	// Devices remembered, the oldest entry is replaced first
+#define DESCRIPTOR_CACHE_ENDPOINTS	4	// Endpoints stored per device
+
+typedef struct CachedEndpoint {
+	uint8_t epAddr;
+	uint8_t maxPktSize;
+	uint8_t direction;
+	uint8_t Interval;
+} __attribute__((packed)) CachedEndpoint;
+
+/* Parsed configuration of a device, keyed by VID/PID/bcdDevice */
+typedef struct CachedConfig {
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t bConfigurationValue;	// Value passed to SetConfiguration
+	uint8_t numEndpoints;			// Used entries in endpoints
+	CachedEndpoint endpoints[DESCRIPTOR_CACHE_ENDPOINTS];
+	uint8_t checksum;				// Catches erased (0xFF) and half written slots
+} __attribute__((packed)) CachedConfig;
+
+/* Configurations of known devices kept in EEPROM, so they can be enabled without reading the descriptors again */
+class DescriptorCache
+{
+
+public:
+	/**
+	*	Looks up a device in the cache.
+	*	@param vid			VID of the device.
+	*	@param pid			PID of the device.
+	*	@param bcdDevice	Release number of the device, a new firmware may change the layout.
+	*	@param config		Filled with the cached configuration on a hit.
+	*	@return True if the device was found.
+	*/
+	static bool Find(uint16_t vid, uint16_t pid, uint16_t bcdDevice, CachedConfig* config);
+
+	/**
+	*	Stores a configuration, replacing the entry of the same device or the oldest one.
+	*	Only bytes that changed are written, so storing a known device again doesn't wear the EEPROM.
+	*	@param config		Configuration to store, the checksum is filled in.
+	*/
+	static void Store(CachedConfig* config);
+
+	/**
+	*	Removes a device from the cache, used when a cached configuration is rejected by the device.
+	*	@param vid			VID of the device.
+	*	@param pid			PID of the device.
+	*	@param bcdDevice	Release number of the device.
+	*/
+	static void Invalidate(uint16_t vid, uint16_t pid, uint16_t bcdDevice);
+
+private:
+	/**
+	*	Finds the slot holding a device.
+	*	@return Slot index, or -1 if the device isn't cached.
+	*/
+	static int8_t FindSlot(uint16_t vid, uint16_t pid, uint16_t bcdDevice, CachedConfig* config);
+
+	/**
+	*	Computes the checksum of an entry, covering everything but the checksum itself.
+	*	@param config		Entry to compute the checksum of.
+	*	@return The checksum.
+	*/
+	static uint8_t Checksum(const CachedConfig* config);
+};
+
+
+#endif /* DESCRIPTORCACHE_H_ */
@@ -21,6 +21,7 @@ public:
 
 	virtual void Process() = 0;
 	virtual bool Configure(const DeviceRecord* record) = 0;
+	virtual void Release() = 0;
 
 	virtual void AddCallback(CallbackFunction callback, void* context) = 0;
 	virtual void OutputRequest(uint8_t requestType, void* params) = 0;
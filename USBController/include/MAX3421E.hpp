@@ -10,14 +10,40 @@
 #define __MAX3421E_H__
 
 #include "SPISerial.hpp"
+#include "USARTSPISerial.hpp"
+#include "ChipSelect.hpp"
 #include "usbdefs.hpp"
 #include "max3421defs.h"
 
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+/* Transport is fixed at compile time, so register access inlines instead of going through ISerial. Every chip has its own chip select */
+#ifdef MAX3421E_USART_TRANSPORT
+typedef USARTSPISerial<PinChipSelect> MAX3421ETransport;	// MOSI/MISO/SCK wired to PJ1/PJ0/PJ2
+#else
+typedef SPISerial<PinChipSelect> MAX3421ETransport;
+#endif
+
+/* Cycle counts come from Timebase and are estimates, they haven't been checked against a measurement on the hardware */
+typedef struct TransferStats {
+	uint32_t transfers;		// Number of tokens dispatched
+	uint32_t spiBytes;		// Bytes clocked over SPI by register access
+	uint32_t busyCycles;	// CPU cycles spent waiting for tokens to complete, not counting time blocked on the INT pin
+} TransferStats;
+
 class MAX3421E
 {
 
 public:
-	MAX3421E();
+	/**
+	*	Several chips can share the bus, each with its own chip select and INT line.
+	*	@param csPort		Port register of the chip select pin.
+	*	@param csPin		Chip select pin within the port.
+	*	@param intLine		External interrupt the INT pin is wired to (INT4-INT7, pins PE4-PE7).
+	*/
+	MAX3421E(volatile uint8_t* csPort = &PORTL, uint8_t csPin = PINL7, uint8_t intLine = MAX3421E_DEFAULT_INT);
 	~MAX3421E();
 	
 	/**
@@ -33,9 +59,10 @@ public:
 	
 	/**
 	*	Probes the USB bus to determine what is connected, and saves the state in busState_.
+	*	@param sample	Have the SIE sample D+ and D- first. Not needed after CONDETIRQ, HRSL is already up to date then.
 	*	@return	State of the bus
 	*/
-	uint8_t ProbeBus();
+	uint8_t ProbeBus(bool sample = true);
 	
 	/**
 	*	Writes multiple bytes to a given register.
@@ -49,8 +76,9 @@ public:
 	*	Writes a single byte to a given register.
 	*	@param byte		Byte to be transmitted.
 	*	@param reg		Register to transmit byte to.
+	*	@return HIRQ as clocked out by the chip while it received the command byte (see GetStatus).
 	*/
-	void WriteSingleToReg(uint8_t byte,uint8_t reg);
+	uint8_t WriteSingleToReg(uint8_t byte,uint8_t reg);
 	
 	/**
 	*	Reads a single byte from given register.
@@ -68,6 +96,114 @@ public:
 	*/
 	uint8_t* ReadMultipleFromReg(uint8_t* datacontainer, uint8_t reg, uint8_t len);
 	
+	/**
+	*	Writes a register through the shadow cache. The SPI write is skipped if the register already holds the value.
+	*	Registers without a shadow slot are always written.
+	*	@param byte		Byte to be written.
+	*	@param reg		Register to write to.
+	*/
+	void WriteShadowedReg(uint8_t byte, uint8_t reg);
+	
+	/**
+	*	Reads a register from the shadow cache, only reads over SPI if the shadow isn't valid yet.
+	*	@param reg		Register to read from.
+	*	@return The register value.
+	*/
+	uint8_t ReadShadowedReg(uint8_t reg);
+	
+	/**
+	*	Marks all shadowed registers as unknown, used when the chip is reset.
+	*/
+	void InvalidateShadow() {shadowValid_ = 0;};
+	
+	/**
+	*	Stores a value just written to the chip in the shadow cache, registers without a shadow slot are ignored.
+	*	@param byte		Byte that was written.
+	*	@param reg		Register it was written to.
+	*/
+	void UpdateShadow(uint8_t byte, uint8_t reg);
+	
+	/**
+	*	Runs a register script from flash. Every op is resolved against the shadow first, then all writes
+	*	go out as one serial job so the bus is only claimed once.
+	*	@param script	RegisterOp array in PROGMEM.
+	*	@param count	Number of ops, at most REG_SCRIPT_MAX.
+	*	@return HIRQ as clocked out by the chip during the last write, the last known HIRQ for an empty script.
+	*/
+	uint8_t RunScript(const RegisterOp* script, uint8_t count);
+	
+	/**
+	*	Finds the fastest reliable SPI clock by writing test patterns to PERADDR and reading them back,
+	*	starting at CLOCK_DIVIDER_MIN. PERADDR is cleared afterwards.
+	*	@return True if a divider passed, false if the chip couldn't be read back at any clock.
+	*/
+	bool CalibrateClock();
+	
+	/**
+	*	Reads PERADDR back every CLOCK_CHECK_INTERVAL ms and compares it with the shadow. When
+	*	CLOCK_ERROR_LIMIT checks within CLOCK_ERROR_WINDOW fail the SPI clock is halved.
+	*/
+	void MonitorClock();
+	
+	/**
+	*	Gets the SPI clock divider currently used.
+	*	@return Clock divider (SPI clock is fosc / divider).
+	*/
+	uint8_t GetClockDivider() const {return clockDivider_;};
+	
+	/**
+	*	Gets the time from the last D+/D- change (CONDETIRQ) to the first device descriptor request.
+	*	@return Attach latency in milliseconds.
+	*/
+	uint16_t GetAttachLatency() const {return attachLatency_;};
+	
+	/**
+	*	Gets the number of enumerations of the connected device that ended in USB_ERROR.
+	*	@return Failure count since power-up.
+	*/
+	uint16_t GetEnumerationFailures() const {return totalFailures_;};
+	
+	/**
+	*	Gets the mean time from the first failure to the next successful enumeration.
+	*	@return Mean time to recover in milliseconds, 0 if nothing has been recovered yet.
+	*/
+	uint32_t GetMeanTimeToRecover() const {return (recoveries_ == 0) ? 0 : recoveryTime_ / recoveries_;};
+	
+	/**
+	*	Gets the time from the last D+/D- change to the first successful IN transfer of the running device.
+	*	@return Attach to first input latency in milliseconds.
+	*/
+	uint16_t GetInputLatency() const {return inputLatency_;};
+	
+	/**
+	*	Checks whether the running device is gone, from CONDETIRQ in the HIRQ byte clocked out with every
+	*	command (no extra SPI traffic) or from USB_DISCONNECT_FAILURES failed transfers in a row.
+	*	Puts the state machine back to enumeration if so.
+	*	@return True if the device has to be torn down.
+	*/
+	bool CheckDisconnect();
+	
+	/**
+	*	Drops all queued asynchronous requests without calling their callbacks, used when the device is gone.
+	*/
+	void CancelTransfers();
+	
+#ifdef MAX3421E_SHADOW_CHECK
+	/**
+	*	Compares the shadowed registers with the chip every SHADOW_CHECK_INTERVAL ms.
+	*	Mismatches are logged and the shadow is updated with the value read from the chip.
+	*	@return True if the shadow matched (or the check wasn't due), false otherwise.
+	*/
+	bool CheckShadow();
+#endif
+	
+	/**
+	*	Gets the status byte captured during the last register access. In full-duplex SPI mode the chip
+	*	clocks out HIRQ while it receives the command byte, so every access reads HIRQ for free.
+	*	@return HIRQ as it was at the start of the last register access.
+	*/
+	uint8_t GetStatus() const {return status_;};
+	
 	/**
 	*	Configures found device from enumeration in a device record and updates the device address.
 	*	@return True if configuration was successful, false otherwise.
@@ -76,9 +212,11 @@ public:
 	
 	/**
 	*	Performs chip reset and waits for internal oscillator to be stable again.
+	*	Runs before the scheduler is started, so the timeout is counted in busy-waited milliseconds.
+	*	@param timeout		Time to wait for the oscillator in milliseconds.
 	*	@return True if reset was successful, false if timeout occurred.
 	*/
-	bool Reset();
+	bool Reset(uint16_t timeout = USB_RESET_TIMEOUT);
 	
 	/**
 	*	Changes state in enumeration state-machine.
@@ -97,9 +235,10 @@ public:
 	*	@param token		Token to be dispatched (could be IN or OUT).
 	*	@param ep			Endpoint address to dispatch token to
 	*	@param naklimit		Amount of NAK's before giving up
+	*	@param timeout		Frames (ms) before giving up, at most 32767.
 	*	@return A host return code specified at * Host result codes * in max3421defs.h 
 	*/
-	uint8_t DispatchPacket(uint8_t token, uint8_t ep, uint8_t naklimit);
+	uint8_t DispatchPacket(uint8_t token, uint8_t ep, uint8_t naklimit, uint16_t timeout = USB_XFER_TIMEOUT);
 	
 	/**
 	*	Performs a control transfer (for numerous descriptors).
@@ -113,31 +252,124 @@ public:
 	*	@param wIdx				Parameter index or offset
 	*	@param wLength			Used to specify how many bytes to be transferred if there is a data stage
 	*	@param data				Address to datacontainer for data in datastage (set to NULL if theres no data stage)
+	*	@param timeout			Frames (ms) for all three stages before giving up, at most 32767.
 	*	@return A host return code specified at * Host result codes * in max3421defs.h 
 	*/
 	uint8_t ControlRequest(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest,
-	uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, uint8_t* data);
+	uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, uint8_t* data, uint16_t timeout = USB_XFER_TIMEOUT);
+	
+	/**
+	*	Performs a control transfer with an IN data stage that is handed to a consumer packet by packet as it
+	*	is drained from the RCVFIFO, so descriptors longer than any buffer can be read.
+	*	@param address			Address of device to request descriptor from.
+	*	@param ep				Endpoint to request from. (should always be 0 specifying the default pipe)
+	*	@param bmRequestType	Request type (must be device to host)
+	*	@param bRequest			The kind of request, for example what kind of descriptor.
+	*	@param wValueLow		Lower byte of request parameter
+	*	@param wValueHigh		Upper byte of request parameter
+	*	@param wIdx				Parameter index or offset
+	*	@param wLength			Number of bytes to be transferred in the data stage
+	*	@param consumer			Called with each received packet (at most 64 bytes).
+	*	@param context			Context passed to the consumer.
+	*	@param timeout			Frames (ms) for all three stages before giving up, at most 32767.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	uint8_t ControlRequestStream(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest,
+	uint8_t wValueLow,uint8_t wValueHigh, uint16_t wIdx, uint16_t wLength, PacketConsumer consumer, void* context, uint16_t timeout = USB_XFER_TIMEOUT);
 	
 	/**
 	*	Performs a BULK-IN Transfer described in https://pdfserv.maximintegrated.com/en/an/AN3785.pdf
 	*	@param pep				Pointer to endpoint to do InTransfer from.
 	*	@param nbytesptr		Pointer to number of bytes to be read
 	*	@param data				Pointer to datacontainer for read data
-	*	@param bInterval		Interval for polling data transfers from specified endpoint.
+	*	@param bInterval		Interval for polling data transfers from specified endpoint in frames (the task sleeps in between).
+	*	@param naklimit			Amount of NAK's before giving up
+	*	@param timeout			Frames (ms) for the whole transfer before giving up, at most 32767.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	uint8_t InTransfer(EpInfo* pep,uint16_t* nbytesptr, uint8_t* data, uint8_t bInterval,uint8_t naklimit, uint16_t timeout = USB_XFER_TIMEOUT);
+	
+	/**
+	*	Performs a pipelined BULK-IN Transfer. The IN token for the next packet is launched before the previous
+	*	packet is drained from the RCVFIFO, and every packet is handed to the consumer instead of a caller buffer.
+	*	Returns when a short packet is received, nbytes have been received or the endpoint NAKs.
+	*	@param pep				Pointer to endpoint to do InTransfer from.
+	*	@param nbytesptr		Pointer to max number of bytes to be read, set to the number of bytes received.
+	*	@param consumer			Called with each received packet (at most 64 bytes).
+	*	@param context			Context passed to the consumer.
 	*	@param naklimit			Amount of NAK's before giving up
+	*	@param timeout			Frames (ms) for the whole transfer before giving up, at most 32767.
 	*	@return A host return code specified at * Host result codes * in max3421defs.h 
 	*/
-	uint8_t InTransfer(EpInfo* pep,uint16_t* nbytesptr, uint8_t* data, uint8_t bInterval,uint8_t naklimit);
+	uint8_t InTransferStream(EpInfo* pep, uint16_t* nbytesptr, PacketConsumer consumer, void* context, uint8_t naklimit, uint16_t timeout = USB_XFER_TIMEOUT);
 	
 	/**
 	*	Performs a BULK-OUT Transfer described in https://pdfserv.maximintegrated.com/en/an/AN3785.pdf
+	*	Data is split into maxPktSize packets, the next packet is loaded into the second SNDFIFO while
+	*	the current one is on the wire. Returns hrNAK when the endpoint gives up or asks for a NAK back-off,
+	*	the packets before the NAK'ed one have been acknowledged already.
 	*	@param pep				Pointer to endpoint to do OutTransfer to.
 	*	@param nbytes			Number of bytes to be transferred
 	*	@param data				Pointer to datacontainer for data to be transmitted
 	*	@param naklimit			Amount of NAK's before giving up
+	*	@param timeout			Frames (ms) for the whole transfer before giving up, at most 32767.
 	*	@return A host return code specified at * Host result codes * in max3421defs.h 
 	*/
-	uint8_t OutTransfer(EpInfo* pep, uint8_t nbytes, uint8_t* data,uint8_t naklimit);
+	uint8_t OutTransfer(EpInfo* pep, uint16_t nbytes, uint8_t* data,uint8_t naklimit, uint16_t timeout = USB_XFER_TIMEOUT);
+	
+	/**
+	*	Queues an asynchronous transfer. The request is driven by ServiceTransfers, which the USB task calls
+	*	when the INT pin signals a finished token. The request and its buffer must stay valid until it is done.
+	*	May be called from any task.
+	*	@param request		Request to queue (ep, address, token, data, length, naklimit and callback must be set,
+	*						state must be URB_IDLE or URB_DONE). A URB_BACKOFF request is resumed where it was NAK'ed.
+	*	@return True if the request was queued, false if it is invalid or already queued.
+	*/
+	bool SubmitTransfer(TransferRequest* request);
+	
+	/**
+	*	Takes the request that was NAK'ed and backs off. It is removed from the queue so other requests can use
+	*	the chip meanwhile, the caller submits it again once its retryTick is due.
+	*	@return The request in URB_BACKOFF, NULL if there is none.
+	*/
+	TransferRequest* TakeDeferredTransfer();
+	
+	/**
+	*	Advances the queued transfer requests. Starts the next request if none is on the wire, otherwise
+	*	waits for the INT pin and handles the finished token. Completion callbacks are called from here.
+	*	Never sleeps for a NAK back-off, the request is deferred instead (see TakeDeferredTransfer).
+	*	@param wait		Ticks to wait for the INT pin (0 to only poll).
+	*	@return True if there are still requests queued, false otherwise.
+	*/
+	bool ServiceTransfers(portTickType wait);
+	
+	/**
+	*	Gets whether a transfer request is queued or on the wire.
+	*	@return True if requests are pending.
+	*/
+	bool TransfersPending() const {return urbHead_ != NULL;};
+	
+	/**
+	*	Caps how long the polling waits of the USB task (scheduler, bus events) may block on this chip, so one task
+	*	can serve several chips in turn. Synchronous transfers are still bounded by their own timeouts only.
+	*	@param budget	Ticks a single wait may block, 0 to only poll. portMAX_DELAY (default) leaves the waits as they are.
+	*/
+	void SetWaitBudget(portTickType budget) {waitBudget_ = budget;};
+	
+	/**
+	*	Clamps a wait to the budget set with SetWaitBudget.
+	*	@param wait		Ticks the caller would like to wait.
+	*	@return	Ticks it may wait.
+	*/
+	portTickType Budget(portTickType wait) const {return (wait < waitBudget_) ? wait : waitBudget_;};
+	
+	/**
+	*	Sleeps until the INT pin of any chip fires. Lets a task polling several chips with a budget of 0 block
+	*	between rounds without waiting on one chip only.
+	*	@param wait		Ticks to sleep at most.
+	*	@return True if an interrupt came in, false on timeout.
+	*/
+	static bool WaitForAnyEvent(portTickType wait);
 	
 	/**
 	*	Loads a specified address into the PERADDR register used to determine where packets should be sent to.
@@ -153,14 +385,53 @@ public:
 	const DeviceRecord* GetActiveDevRecord() const;
 	
 	/**
-	*	Enumerates USB to find connected devices. Uses a state-machine to perform enumeration.
+	*	Enumerates USB to find connected devices. Uses a state-machine to perform enumeration, the entry action,
+	*	dwell time, deadline and retry policy of every state come from a table. Never sleeps, except on the INT
+	*	pin while disconnected.
 	*/
 	void Enumerate();
+	
+	/**
+	*	Logs the time spent in each enumeration state during the last attempt.
+	*/
+	void PrintEnumerationTimes();
 
 	/**
 	*	Prints the VID and PID of the found device-descriptor.
 	*/
 	void PrintDeviceInfo();
+	
+	/**
+	*	Called from the INT pin interrupts. Wakes up the task waiting in DispatchPacket on the chip wired to the line.
+	*	@param line		External interrupt that fired (INT4-INT7).
+	*/
+	static void HandleInterrupt(uint8_t line);
+
+#ifdef MAX3421E_STATS
+	/**
+	*	Gets the SPI and CPU cost of the transfers dispatched since the last reset of the counters.
+	*	@return Reference to the transfer counters.
+	*/
+	const TransferStats& GetTransferStats() const {return stats_;};
+	
+	/**
+	*	Resets the transfer counters.
+	*/
+	void ResetTransferStats();
+	
+	/**
+	*	Prints the average SPI bytes and CPU cycles spent per dispatched token.
+	*/
+	void PrintTransferStats();
+	
+	/**
+	*	Measures a PERADDR write and read-back with the chip selected (averaged over SERIAL_BENCHMARK_ROUNDS)
+	*	and a SERIAL_BENCHMARK_BYTES burst read of PERADDR, and prints both with the read-back errors.
+	*	PERADDR is restored afterwards, so only call it while no transfer is in flight.
+	*	Build with and without MAX3421E_USART_TRANSPORT to compare the transports.
+	*/
+	void BenchmarkSerial();
+#endif
 
 	// Inline methods
 	/**
@@ -209,6 +480,19 @@ public:
 	inline uint8_t GetConfigDescriptor(uint8_t addr, uint8_t ep, unsigned int nbytes, uint8_t* dataPtr){
 		return (ControlRequest(addr,ep,bmREQ_GET_DESCR,USB_REQUEST_GET_DESCRIPTOR, 0x00,USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, dataPtr));
 	}
+	
+	/**
+	*	Gets the configuration descriptor set (configuration, interface, endpoint and class descriptors) packet by packet.
+	*	@param addr			Device address to get configuration descriptor from.
+	*	@param ep			Should always be zero to specify the default pipeline.
+	*	@param nbytes		Number of bytes to be read, usually wTotalLength.
+	*	@param consumer		Called with each received packet.
+	*	@param context		Context passed to the consumer.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	inline uint8_t GetConfigDescriptorStream(uint8_t addr, uint8_t ep, uint16_t nbytes, PacketConsumer consumer, void* context){
+		return (ControlRequestStream(addr,ep,bmREQ_GET_DESCR,USB_REQUEST_GET_DESCRIPTOR, 0x00,USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, consumer, context));
+	}
 
 	/**
 	*	Gets an interface descriptor from a specified device with a specified interface number.
@@ -235,10 +519,264 @@ public:
 	}
 
 private:
-	SPISerial* spi_;
+	/**
+	*	Waits for the INT pin to signal a completed transfer (HXFRDNIRQ), at least one poll is done even
+	*	if the deadline has passed already.
+	*	@param hrsl		Set to the HRSL register of the finished transfer.
+	*	@param deadline	Tick after which the transfer is given up.
+	*	@return True if the transfer completed, false if the deadline passed.
+	*/
+	bool WaitForTransferDone(uint8_t* hrsl, portTickType deadline);
+	
+	/**
+	*	Stops a token that never completed with a bus reset, so the next token doesn't start in a busy SIE.
+	*	Marks the device as gone (see CheckDisconnect), it has to be enumerated again.
+	*/
+	void StopTransferEngine();
+	
+	/**
+	*	Sleeps until INT signals a connect or disconnect (CONDETIRQ) and clears it. HIRQ is checked after
+	*	the timeout as well, so an edge that was missed isn't lost. With shorter waits HIRQ is read at most
+	*	every USB_CONNECT_WAIT ticks unless INT fired, so polling doesn't keep the SPI bus busy.
+	*	@param wait		Ticks to sleep at most, 0 to only poll.
+	*	@return True if CONDETIRQ was set, attachTick_ is then the tick of the bus change.
+	*/
+	bool WaitForBusEvent(portTickType wait);
+	
+	/**
+	*	Fails the current enumeration state, goes to its retry state or USB_ERROR when the retries are used up.
+	*/
+	void RetryState();
+	
+	/**
+	*	Ends the current enumeration in USB_ERROR and counts the failure for the recovery back-off.
+	*/
+	void FailEnumeration();
+	
+	/**
+	*	Gets the time to wait in USB_ERROR before recovering, doubles with every failure in a row.
+	*	@return Back-off in milliseconds.
+	*/
+	uint16_t RecoveryBackoff() const;
+	
+	/**
+	*	Checks HRSL and the HXFRDNIRQ bit that comes with it, and clears HXFRDNIRQ if it's set.
+	*	@param hrsl		Set to the HRSL register.
+	*	@return True if the transfer is done, false otherwise.
+	*/
+	bool PollTransferDone(uint8_t* hrsl);
+	
+	/**
+	*	Launches a token without waiting for the transfer to complete.
+	*	@param token		Token to be dispatched.
+	*	@param ep			Endpoint address to dispatch token to.
+	*/
+	void LaunchPacket(uint8_t token, uint8_t ep);
+	
+	/**
+	*	Loads a setup packet into SUDFIFO and launches the SETUP token in one serial job.
+	*	@param setup		Setup packet (8 bytes).
+	*	@param ep			Endpoint address to dispatch token to.
+	*/
+	void LaunchSetup(const uint8_t* setup, uint8_t ep);
+	
+	/**
+	*	Waits for a launched token to complete and relaunches it on NAK, timeouts and stalls. Never sleeps for a
+	*	NAK back-off, hrNAK is returned instead.
+	*	@param token		Token that was launched.
+	*	@param ep			Endpoint address the token was launched to.
+	*	@param naklimit		Amount of NAK's before giving up
+	*	@param pep			Endpoint whose NAK policy applies (NULL uses NAK_POLICY_LIMIT).
+	*	@param deadline		Tick after which the token isn't relaunched anymore.
+	*	@param outData		Packet of an OUT token, reloaded before a NAK'ed token is relaunched (NULL for other tokens).
+	*	@param outSize		Size of the OUT packet.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	uint8_t FinishPacket(uint8_t token, uint8_t ep, uint8_t naklimit, EpInfo* pep, portTickType deadline,
+	uint8_t* outData = NULL, uint8_t outSize = 0);
+	
+	/**
+	*	Runs the three stages of a control transfer, the IN data stage goes either into a buffer or through a consumer.
+	*	Parameters are the ones of ControlRequest and ControlRequestStream.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	uint8_t ControlTransfer(uint8_t address, uint8_t ep, uint8_t bmRequestType, uint8_t bRequest, uint8_t wValueLow,uint8_t wValueHigh,
+	uint16_t wIdx, uint16_t wLength, uint8_t* data, PacketConsumer consumer, void* context, uint16_t timeout);
+	
+	/**
+	*	Checks a deadline against the tick count (one tick is one frame), deadlines must be less than 32768 ticks ahead.
+	*	@param deadline		Tick of the deadline.
+	*	@return True if the deadline has passed.
+	*/
+	bool DeadlinePassed(portTickType deadline) const {return (portTickType)(xTaskGetTickCount() - deadline) < portMAX_DELAY / 2;};
+	
+	/**
+	*	Applies the NAK policy of an endpoint to a NAK'ed token and updates its NAK counters.
+	*	@param pep			Endpoint that NAK'ed (NULL uses NAK_POLICY_LIMIT).
+	*	@param nakCount		NAKs recieved for the current packet, including this one.
+	*	@param firstNak		Tick of the first NAK for the current packet.
+	*	@param naklimit		Amount of NAK's before giving up
+	*	@return Frames to wait before relaunching the token, or NAK_GIVE_UP.
+	*/
+	uint8_t NakBackoff(EpInfo* pep, uint16_t nakCount, portTickType firstNak, uint8_t naklimit);
+	
+	/**
+	*	Loads a packet into the free SNDFIFO and commits it to the SIE by writing SNDBC.
+	*	@param data			Packet data.
+	*	@param nbytes		Packet size (at most 64 bytes).
+	*/
+	void LoadSndFifo(uint8_t* data, uint8_t nbytes);
+	
+	/**
+	*	Loads a NAK'ed OUT packet again before it is relaunched. Works around the host OUT NAK erratum, the SIE
+	*	doesn't resend the packet reliably, so SNDBC is cleared, the packet rewritten and SNDBC set again.
+	*	Both sndfifos end up reset, a packet preloaded into the second one is lost.
+	*	@param data			Packet data.
+	*	@param nbytes		Packet size (at most 64 bytes).
+	*/
+	void ReloadSndFifo(uint8_t* data, uint8_t nbytes);
+	
+	/**
+	*	Receives IN packets either into a buffer or through a consumer. Without a polling interval the next
+	*	IN token is launched while the previous packet is drained, using both RCVFIFOs.
+	*	@param pep				Pointer to endpoint to receive from.
+	*	@param nbytesptr		Pointer to number of bytes to be read, set to the number of bytes received.
+	*	@param data				Buffer for received data, NULL when a consumer is used.
+	*	@param consumer			Called with each received packet, NULL when a buffer is used.
+	*	@param context			Context passed to the consumer.
+	*	@param bInterval		Interval between packets in frames, 0 enables pipelining.
+	*	@param naklimit			Amount of NAK's before giving up
+	*	@param deadline			Tick after which no more tokens are launched.
+	*	@return A host return code specified at * Host result codes * in max3421defs.h 
+	*/
+	uint8_t ReceivePackets(EpInfo* pep, uint16_t* nbytesptr, uint8_t* data, PacketConsumer consumer, void* context, uint8_t bInterval,uint8_t naklimit, portTickType deadline);
+	
+	/**
+	*	Drains RCVFIFO into a packet buffer and hands it to a consumer. Kept out of line, so the buffer is
+	*	only on the stack while a packet is consumed and buffered transfers don't pay for it.
+	*	@param nbytes			Bytes in RCVFIFO (at most 64).
+	*	@param consumer			Called with the packet.
+	*	@param context			Context passed to the consumer.
+	*/
+	void ConsumePacket(uint8_t nbytes, PacketConsumer consumer, void* context) __attribute__((noinline));
+	
+	/**
+	*	Sets up the address and toggle of a queued request and launches its first token.
+	*	@param request		Request at the head of the queue.
+	*/
+	void StartTransfer(TransferRequest* request);
+	
+	/**
+	*	Sets up the toggle of the data stage and loads the first OUT packet.
+	*	@param request		Request at the head of the queue.
+	*	@return True if the data stage can be launched, false if the request was completed with an error.
+	*/
+	bool StartDataStage(TransferRequest* request);
+	
+	/**
+	*	Gets the direction of a request's data stage.
+	*	@param request		Request to examine.
+	*	@return True for device to host, false otherwise.
+	*/
+	bool TransferIsIn(const TransferRequest* request) const;
+	
+	/**
+	*	Gets the token to launch for the current stage of a request.
+	*	@param request		Request to examine.
+	*	@return Token to launch.
+	*/
+	uint8_t StageToken(const TransferRequest* request) const;
+	
+	/**
+	*	Handles the result of a finished token of the active request, relaunches it or completes the request.
+	*	@param request		Request at the head of the queue.
+	*	@param result		Host result code of the token.
+	*/
+	void AdvanceTransfer(TransferRequest* request, uint8_t result);
+	
+	/**
+	*	Takes a NAK'ed request off the queue until its back-off has passed, see TakeDeferredTransfer.
+	*	@param request		Request at the head of the queue.
+	*	@param backoff		Frames to wait before relaunching the packet.
+	*/
+	void DeferTransfer(TransferRequest* request, uint8_t backoff);
+	
+	/**
+	*	Relaunches the NAK'ed packet of a deferred request. Other requests may have used the chip meanwhile,
+	*	so the address, toggle and OUT packet are set up again.
+	*	@param request		Request at the head of the queue.
+	*/
+	void ResumeTransfer(TransferRequest* request);
+	
+	/**
+	*	Removes the request from the queue and calls its completion callback.
+	*	@param request		Request at the head of the queue.
+	*	@param rcode		Host result code of the request.
+	*/
+	void CompleteTransfer(TransferRequest* request, uint8_t rcode);
+	
+	/**
+	*	Blocks until the request on the wire is done, so synchronous transfers can use the chip.
+	*/
+	void CompleteActiveTransfer();
+	
+	/**
+	*	Maps a register to its slot in the shadow cache.
+	*	@param reg		Register to look up.
+	*	@return Slot index, or SHADOW_NONE if the register isn't shadowed.
+	*/
+	int8_t ShadowIndex(uint8_t reg);
 
+	MAX3421ETransport spi_;
+	
+	static MAX3421E* instances_[MAX3421E_INT_LINES];	// Chip served by each INT pin interrupt
+	uint8_t intLine_;
+	xSemaphoreHandle xferSemaphore_;	// Given from the INT pin interrupt on HXFRDNIRQ, and on CONDETIRQ only while disconnected
+	static xSemaphoreHandle anyEventSemaphore_;	// Given from every INT pin interrupt, see WaitForAnyEvent
+	portTickType waitBudget_;		// Longest polling wait, see SetWaitBudget
+	volatile portTickType intTick_;		// Tick of the last INT edge, set from the interrupt
+	
+	TransferRequest* urbHead_;		// Queue of asynchronous transfer requests, head is the active one
+	TransferRequest* urbTail_;
+	portTickType urbLaunchTick_;	// Tick the active request's token was launched
+	TransferRequest* urbDeferred_;	// NAK'ed request waiting to be taken by TakeDeferredTransfer
+	bool sndReloaded_;				// FinishPacket reloaded a NAK'ed OUT packet, see ReloadSndFifo
+
+#ifdef MAX3421E_STATS
+	TransferStats stats_;
+	uint32_t blockedCycles_;		// Cycles the current dispatch has spent blocked on xferSemaphore_
+#endif
+
+	uint8_t status_;	// HIRQ clocked out during the last command byte
+	
+	uint8_t shadow_[SHADOW_COUNT];	// Write-through copies of MODE, PERADDR and HIEN
+	uint8_t shadowValid_;			// Bit per shadow slot, set when the slot holds the chip's value
+#ifdef MAX3421E_SHADOW_CHECK
+	portTickType lastShadowCheck_;
+#endif
+	
+	uint8_t clockDivider_;			// SPI clock is fosc / clockDivider_
+	portTickType lastClockCheck_;
+	uint8_t clockChecks_;			// Read-back checks in the current window
+	uint8_t clockErrors_;			// Failed read-back checks in the current window
+	
 	uint8_t busState_;
 	uint8_t usbState_;
+	portTickType stateTick_;		// Tick the current state was entered
+	uint8_t enumRetries_;			// Failed attempts of the current enumeration
+	uint16_t enumTimes_[USB_STATE_COUNT];	// ms spent in each state during the current enumeration
+	uint8_t enumFailures_;			// Enumerations in a row that ended in USB_ERROR, sets the recovery back-off
+	uint16_t totalFailures_;
+	portTickType failTick_;			// Tick of the first failure in the current row
+	uint16_t recoveries_;			// Successful enumerations after a failure
+	uint32_t recoveryTime_;			// ms from first failure to recovery, summed over all recoveries
+	bool busSampled_;				// Bus has been sampled since Initialize, later changes come from CONDETIRQ
+	portTickType attachTick_;		// Tick D+/D- changed on the last connect
+	portTickType busCheckTick_;		// Tick HIRQ was last read for CONDETIRQ while disconnected
+	uint16_t attachLatency_;		// ms from attachTick_ to the first device descriptor request
+	bool inputPending_;				// No IN transfer has succeeded since attachTick_
+	uint16_t inputLatency_;			// ms from attachTick_ to the first successful IN transfer
+	uint8_t xferFailures_;			// Asynchronous transfers failed in a row
 	
 	EpInfo ep_;
 	UsbDevice* usb_;
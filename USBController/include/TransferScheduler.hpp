@@ -0,0 +1,116 @@
+/*
+ * TransferScheduler.h
+ *
+ * Created: 17/10/2026 13.05.21
+ *  Author: Nicklas Grunert (@github.com/LordSyFo)
+ */ 
+
+
+#ifndef TRANSFERSCHEDULER_H_
+#define TRANSFERSCHEDULER_H_
+
+#include "MAX3421E.hpp"
+#include "usbdefs.hpp"
+
+#define MAX_PERIODIC_TRANSFERS 4
+
+typedef struct PeriodicTransfer {
+	TransferRequest* request;	// Request resubmitted every interval frames (NULL if slot is free)
+	uint8_t interval;			// Polling interval in frames (bInterval)
+	portTickType nextFrame;		// Frame the request is due
+} PeriodicTransfer;
+
+class TransferScheduler {
+	
+public:
+	TransferScheduler(MAX3421E* max);
+	
+	/**
+	*	Adds an interrupt endpoint transfer that is submitted every interval frames.
+	*	Periodic transfers are always scheduled before queued control and bulk transfers.
+	*	@param request		Request to submit (must stay valid until removed).
+	*	@param interval		Polling interval in frames, usually bInterval of the endpoint.
+	*	@return True if the transfer was added, false if there was no free slot.
+	*/
+	bool AddPeriodicTransfer(TransferRequest* request, uint8_t interval);
+	
+	/**
+	*	Stops submitting a periodic transfer.
+	*	@param request		Request that was added with AddPeriodicTransfer.
+	*/
+	void RemovePeriodicTransfer(TransferRequest* request);
+	
+	/**
+	*	Queues a one-shot transfer. Control requests (SETUP_TOKEN) go into the control queue, which is
+	*	served before the bulk queue holding all other requests. May be called from any task.
+	*	@param request		Request to queue (must stay valid until it is done).
+	*	@return True if the request was queued, false if it is already queued.
+	*/
+	bool QueueTransfer(TransferRequest* request);
+	
+	/**
+	*	Runs one scheduling step: services the request on the wire, or submits the most overdue periodic
+	*	transfer, a NAK'ed request whose back-off has passed, or the next control or bulk transfer.
+	*	Sleeps until the next frame if nothing is due.
+	*/
+	void Schedule();
+	
+	/**
+	*	Drops all periodic and queued transfers, used when the device is gone.
+	*/
+	void Clear();
+	
+	/**
+	*	Gets whether a request is waiting in a queue or on the wire.
+	*	@param request		Request to examine.
+	*	@return True if the request isn't done yet.
+	*/
+	static bool IsBusy(const TransferRequest* request) {
+		return request->state == URB_SCHEDULED || request->state == URB_QUEUED || request->state == URB_IN_FLIGHT
+			|| request->state == URB_BACKOFF;
+	};
+	
+private:
+	/**
+	*	Appends a request to a queue.
+	*	@param head		Queue head.
+	*	@param tail		Queue tail.
+	*	@param request	Request to append.
+	*/
+	void Push(TransferRequest** head, TransferRequest** tail, TransferRequest* request);
+	
+	/**
+	*	Removes the first request of a queue.
+	*	@param head		Queue head.
+	*	@param tail		Queue tail.
+	*	@return The removed request, NULL if the queue was empty.
+	*/
+	TransferRequest* Pop(TransferRequest** head, TransferRequest** tail);
+	
+	/**
+	*	Services the request on the wire and takes it back if it was NAK'ed and backs off.
+	*	@param wait		Ticks to wait for the INT pin (0 to only poll).
+	*/
+	void Service(portTickType wait);
+	
+	/**
+	*	Removes the deferred request whose back-off has passed the longest ago.
+	*	@param frame	Current frame.
+	*	@return The removed request, NULL if none is due.
+	*/
+	TransferRequest* PopDeferred(portTickType frame);
+	
+	MAX3421E* max_;
+	
+	PeriodicTransfer periodic_[MAX_PERIODIC_TRANSFERS];
+	
+	TransferRequest* controlHead_;
+	TransferRequest* controlTail_;
+	TransferRequest* bulkHead_;
+	TransferRequest* bulkTail_;
+	TransferRequest* deferredHead_;		// NAK'ed requests waiting for their retryTick
+	TransferRequest* deferredTail_;
+};
+
+
+#endif /* TRANSFERSCHEDULER_H_ */
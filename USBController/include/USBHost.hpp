@@ -10,6 +10,7 @@
 #define USBHOST_H_
 
 #include "MAX3421E.hpp"
+#include "TransferScheduler.hpp"
 #include "IDeviceConfig.hpp"
 
 #define MAX_DEVICE_CFGS 1
@@ -17,7 +18,13 @@
 class USBHost {
 	
 public:
-	USBHost();
+	/**
+	*	Every host drives its own MAX3421E.
+	*	@param csPort		Port register of the chip's chip select pin.
+	*	@param csPin		Chip select pin within the port.
+	*	@param intLine		External interrupt the chip's INT pin is wired to (INT4-INT7).
+	*/
+	USBHost(volatile uint8_t* csPort = &PORTL, uint8_t csPin = PINL7, uint8_t intLine = MAX3421E_DEFAULT_INT);
 	~USBHost();
 	
 	/**
@@ -66,8 +73,15 @@ public:
 	*/
 	MAX3421E* GetMax() {return &max_;}
 	
+	/**
+	*	Gets the scheduler ordering the transfers of the active device.
+	*	@return	Pointer to the transfer scheduler.
+	*/
+	TransferScheduler* GetScheduler() {return &scheduler_;}
+	
 private:
 	MAX3421E max_;
+	TransferScheduler scheduler_;
 	
 	IDeviceConfig* deviceConfigs_[MAX_DEVICE_CFGS];
 	
@@ -81,6 +95,11 @@ private:
 	uint8_t nCallbackFunctionsQueue_;
 	void AddCallbacksToConfig();
 	
+	/**
+	*	Tears down the active config after a disconnect and goes back to enumeration.
+	*/
+	void ReleaseDevice();
+	
 };
 
 
@@ -10,8 +10,11 @@
 #define XBOXDEVICECONFIG_H_
 
 #include "MAX3421E.hpp"
+#include "TransferScheduler.hpp"
 #include "IDeviceConfig.hpp"
 #include "xboxdefs.hpp"
+#include "DescriptorCache.hpp"
+#include "ConfigDescriptorParser.hpp"
 
 #include "FreeRTOS.h"
 #include "semphr.h"
@@ -19,7 +22,7 @@
 class XboxDeviceConfig : public IDeviceConfig{
 	
 public:
-	XboxDeviceConfig(MAX3421E* max);
+	XboxDeviceConfig(MAX3421E* max, TransferScheduler* scheduler);
 	virtual ~XboxDeviceConfig();
 
 	/**
@@ -28,12 +31,25 @@ public:
 	void FlushInput();
 
 	/**
-	*	Polls data from input endpoint responsible for keypresses.
-		If theres new data available it reads this and passes it to callback functions,
-		saved in callbackFunctions_.
+	*	Starts polling the input endpoint responsible for keypresses. The scheduler submits the
+		input request every bInterval frames and HandleInput is called with the result.
 	*/
 	void PollInputs();
 	
+	/**
+	*	Handles a finished input request. If theres new data available it passes it to callback
+		functions, saved in callbackFunctions_.
+	*	@param request	The finished input request.
+	*/
+	void HandleInput(TransferRequest* request);
+	
+	/**
+	*	Completion callback for the periodic input request.
+	*	@param request	The finished transfer request.
+	*	@param context	Pointer to the XboxDeviceConfig instance.
+	*/
+	static void InputDoneWrapper(TransferRequest* request, void* context);
+	
 	/**
 	*	Polls requests from USBHost to rumble controller.
 	*/
@@ -52,9 +68,15 @@ public:
 	void RequestRumble(uint8_t leftRumble, uint8_t rightRumble);
 	
 	/**
-	*	Rumble the controller with saved motor speeds in leftRumble_ and rightRumble_
+	*	Rumble the controller with saved motor speeds in leftRumble_ and rightRumble_.
+		The motors are stopped again by StopRumble after RUMBLE_DURATION ms.
 	*/
 	void DoRumbleController();
+	
+	/**
+	*	Queues the packet stopping the rumble motors once RUMBLE_DURATION ms have passed.
+	*/
+	void StopRumble();
 
 	/**
 	*	Request a specific animation for the LEDs
@@ -63,10 +85,17 @@ public:
 	void RequestLED(uint8_t ledAnimation);
 	
 	/**
-	*	Upload the LED animation found in ledAnimation_
+	*	Upload the LED animation found in ledAnimation_. The packet is queued as background traffic.
 	*/
 	void DoLEDAnimation();
 	
+	/**
+	*	Completion callback for asynchronous output requests.
+	*	@param request	The finished transfer request.
+	*	@param context	Pointer to the XboxDeviceConfig instance.
+	*/
+	static void OutputDoneWrapper(TransferRequest* request, void* context);
+	
 	/**
 	*	Get the VID specific for Xbox-360 Controllers
 	*	@return		VID for Xbox-360 controllers
@@ -92,6 +121,12 @@ public:
 	*/
 	virtual bool Configure(const DeviceRecord* record);
 	
+	/**
+	*	Drops the state of a disconnected controller so the config can take the next one. Callbacks are
+		removed too, USBHost adds them again when the next device is configured.
+	*/
+	virtual void Release();
+	
 	/**
 	*	Adds a callback function to be called for changes in the input endpoint (keypresses).
 	*	@param	callback	Callback-function to be added
@@ -107,7 +142,32 @@ public:
 	virtual void OutputRequest(uint8_t requestType, void* params);
 	
 private:
+	/**
+	*	Sets both endpoints to the default layout, DATA0 toggles and cleared NAK counters.
+	*/
+	void ResetEndpoints();
+	
+	/**
+	*	Takes the interrupt endpoints of the gamepad interface from a parsed configuration, the defaults
+		are kept if the interface isn't found.
+	*	@param parser	Parser that has read the configuration descriptor set.
+	*/
+	void LoadParsedEndpoints(const ConfigDescriptorParser* parser);
+	
+	/**
+	*	Copies the endpoint layout (input, then output endpoint) into a cache entry.
+	*	@param cached	Cache entry to fill.
+	*/
+	void StoreCachedEndpoints(CachedConfig* cached);
+	
+	/**
+	*	Restores the endpoint layout from a cache entry.
+	*	@param cached	Cache entry found for the device.
+	*/
+	void LoadCachedEndpoints(const CachedConfig* cached);
+	
 	MAX3421E* max_;
+	TransferScheduler* scheduler_;
 	
 	int pid_;
 	int vid_;
@@ -131,6 +191,18 @@ private:
 	uint8_t ledAnimation_;
 	bool led_;				// used to activate led animation
 	
+	uint8_t devAddress_;
+	uint8_t ledPacket_[3];			// must stay valid while ledRequest_ is queued
+	TransferRequest ledRequest_;
+	
+	uint8_t inputPacket_[32];
+	TransferRequest inputRequest_;
+	
+	uint8_t rumblePacket_[8];
+	TransferRequest rumbleRequest_;
+	bool rumbleStopPending_;		// reset rumble packet has to be sent at rumbleStopTick_
+	portTickType rumbleStopTick_;
+	
 };
 
 
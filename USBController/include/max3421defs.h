@@ -59,6 +59,13 @@
 
 #define PINCTL 17
 
+// Register shadow slots (HCTL isn't shadowed as its bits are strobes cleared by the SIE)
+#define SHADOW_MODE		0
+#define SHADOW_PERADDR	1
+#define SHADOW_HIEN		2
+#define SHADOW_COUNT	3
+#define SHADOW_NONE		-1
+
 // Register bits
 #define SNDTOG1		7
 #define SNDTOG0		6
@@ -87,6 +94,8 @@
 #define RWUIE		1
 #define BUSEVENTIE	0
 
+#define IE			0
+
 #define FDUPSPI		4
 #define INTLEVEL	3
 #define POSINT		2
@@ -132,12 +141,71 @@
 #define USB_ADDRESSING										0x0a
 #define USB_CONFIGURING										0x0c
 #define USB_RUNNING											0x0b
+#define USB_STATE_COUNT										0x0d	// States index the enumeration table (EnumStep)
+
+/* Transfer request states */
+#define URB_IDLE		0
+#define URB_QUEUED		1
+#define URB_IN_FLIGHT	2
+#define URB_DONE		3
+#define URB_SCHEDULED	4	// Waiting in a TransferScheduler queue
+#define URB_BACKOFF		5	// NAK'ed, handed back to the TransferScheduler until retryTick
+
+/* Transfer request stages */
+#define URB_STAGE_SETUP		0
+#define URB_STAGE_DATA		1
+#define URB_STAGE_STATUS	2
+
+/* Command byte for a register access */
+#define REG_READ(reg)		((reg)<<3)				// Shift register to REG0-REG4 and set R-bit (0)
+#define REG_WRITE(reg)		(((reg)<<3) | 0x02)		// Shift register to REG0-REG4 and set WR-bit (1)
+
+/* INT lines, each chip uses one of the external interrupts INT4-INT7 (pins PE4-PE7) */
+#define MAX3421E_INT_FIRST		4
+#define MAX3421E_INT_LINES		4
+#define MAX3421E_DEFAULT_INT	4		// used to be PINH6 (no external or pin-change interrupt on PH6) rewired to INT4
+
+/* SPI clock calibration */
+#define CLOCK_DIVIDER_MIN		2		// fosc/2 = 8MHz
+#define CLOCK_DIVIDER_MAX		128		// fosc/128 = 125kHz
+#define CLOCK_CAL_ROUNDS		16		// Rounds of PERADDR write/read-back a divider has to pass
+#define CLOCK_CHECK_INTERVAL	100		// ms between read-back checks while running
+#define CLOCK_ERROR_WINDOW		32		// Checks counted before the error count starts over
+#define CLOCK_ERROR_LIMIT		2		// Failed checks within the window before stepping the clock down
+
+#define SERIAL_BENCHMARK_BYTES	64	// One FIFO
+#define SERIAL_BENCHMARK_ROUNDS	64	// Register round trips averaged
+
+/* Register scripts (RegisterOp) */
+#define REG_MASK_ALL			0xFF	// Plain write, no read-modify-write
+#define REG_SCRIPT_MAX			8		// Most ops run as one serial job
+
+/* NAK policies (EpInfo::nakPolicy) */
+#define NAK_POLICY_LIMIT	0	// Retry right away, give up after naklimit NAKs
+#define NAK_POLICY_BACKOFF	1	// Retry after 1, 2, 4 .. 2^bmNakPower frames, give up after naklimit NAKs
+#define NAK_POLICY_FRAMES	2	// Retry right away, give up when nakFrames frames have passed since the first NAK
+#define NAK_MAX_POWER		7	// Longest back-off is 128 frames
+#define NAK_GIVE_UP			0xFF
 
 #define USB_XFER_TIMEOUT    5000    //USB transfer timeout in milliseconds, per section 9.2.6.1 of USB 2.0 spec
 #define USB_NAK_LIMIT       32000   //NAK limit for a transfer. o meand NAKs are not counted
 #define USB_RETRY_LIMIT     3       //retry limit for a transfer
-#define USB_SETTLE_DELAY    200     //settle delay in milliseconds
+#define USB_SETTLE_DELAY    100     //settle delay in milliseconds, attach debounce TATTDB per section 7.1.7.3 of USB 2.0 spec
+#define USB_RESET_TIMEOUT   255     //oscillator startup timeout after chip reset in milliseconds
 #define USB_NAK_NOWAIT      1       //used in Richard's PS2/Wiimote code
+#define USB_MAX_PACKET_SIZE 64      //largest full-speed packet, one FIFO
+#define USB_XFER_IRQ_TIMEOUT 5      //ticks to wait for HXFRDNIRQ on the INT pin before polling HIRQ for it
+#define USB_XFER_ABORT_TIMEOUT 20   //ticks a token may stay on the wire before the SIE is stopped with a bus reset
+#define SHADOW_CHECK_INTERVAL 1000 //ms between checks of the register shadow against the chip (MAX3421E_SHADOW_CHECK)
+#define USB_CONNECT_WAIT    20      //ticks the host task sleeps on INT for CONDETIRQ while disconnected, bounds the latency other hosts on the task see
+#define USB_SAMPLE_TIMEOUT  10      //HCTL reads before SAMPLEBUS is given up
+#define USB_BUS_RESET_TIMEOUT 100   //ms for the SIE to finish a bus reset (BUSRST)
+#define USB_SOF_TIMEOUT     10      //ms to wait for the first frame marker after SOFKAENAB
+#define USB_SOF_SETTLE_DELAY 10     //ms of frame markers before the first request, reset recovery TRSTRCY per section 9.2.6.2
+#define USB_ENUM_RETRIES    3       //times a failed enumeration goes back to USB_INITIALIZE before USB_ERROR
+#define USB_RECOVERY_DELAY  50      //ms in USB_ERROR before the first recovery, doubled on every failure in a row
+#define USB_RECOVERY_MAX_POWER 7    //back-off stops doubling at USB_RECOVERY_DELAY << USB_RECOVERY_MAX_POWER
+#define USB_DISCONNECT_FAILURES 8   //asynchronous transfers failing in a row before the device is considered gone
 
 // Request types
 #define GET_STATUS SetupPackage(0b10000000,0x00,0x00,0x00,0x02)
@@ -204,6 +272,12 @@
 #define USB_DESCRIPTOR_INTERFACE_POWER          0x08    // bDescriptorType for Interface Power.
 #define USB_DESCRIPTOR_OTG                      0x09    // bDescriptorType for an OTG Descriptor.
 
+/* Endpoint transfer types (bmAttributes bits 1..0 of an Endpoint Descriptor) */
+#define USB_TRANSFER_TYPE_CONTROL               0x00
+#define USB_TRANSFER_TYPE_ISOCHRONOUS           0x01
+#define USB_TRANSFER_TYPE_BULK                  0x02
+#define USB_TRANSFER_TYPE_INTERRUPT             0x03
+
 // Control requests
 #define bmREQ_GET_DESCR     USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //get descriptor request type
 #define bmREQ_SET           USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //set request type for all but 'set feature' and 'set interface'
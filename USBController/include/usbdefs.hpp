@@ -11,6 +11,7 @@
 #include <stdint.h>
 
 typedef void (*CallbackFunction)(void*,void*);
+typedef void (*PacketConsumer)(uint8_t* packet, uint8_t len, void* context);	// Called once per received packet
 
 /* Most of the names corresponds to names in https://www.beyondlogic.org/usbnutshell/usb1.shtml */
 
@@ -23,10 +24,32 @@ typedef struct EpInfo {
 	
 	uint8_t bmSndToggle;	// Send data toggle
 	uint8_t bmRcvToggle;	// Recieve data toggle
-	uint8_t bmNakPower;
+	uint8_t bmNakPower;		// Longest NAK back-off is 2^bmNakPower frames (NAK_POLICY_BACKOFF)
+	
+	uint8_t nakPolicy;		// How NAKs are retried (see NAK policies in max3421defs.h)
+	uint8_t nakFrames;		// Frames to keep retrying after the first NAK (NAK_POLICY_FRAMES)
+	uint16_t nakCount;		// NAKs recieved on this endpoint
+	uint16_t nakGiveUps;	// Transfers ended by the NAK policy
 	
 } __attribute__((packed)) EpInfo;
 
+/* One step of a register script (see MAX3421E::RunScript), scripts are kept in flash */
+typedef struct RegisterOp {
+	uint8_t reg;			// Register to write
+	uint8_t value;			// Value of the bits selected by mask
+	uint8_t mask;			// REG_MASK_ALL writes value as is, otherwise the other bits are kept from the shadow
+} RegisterOp;
+
+/* Entry action, timing and retry policy of an enumeration state (see MAX3421E::Enumerate), the table is kept in flash */
+typedef struct EnumStep {
+	const RegisterOp* entry;	// Register script run when the state is entered, NULL for none
+	uint8_t entryLength;
+	uint16_t dwell;				// ms the state waits after entry before it is polled
+	uint16_t timeout;			// ms the state may be polled before it fails, 0 for no deadline
+	uint8_t retries;			// Failed attempts allowed before USB_ERROR
+	uint8_t retryState;			// State a failed attempt goes back to
+} EnumStep;
+
 // TODO: This will probably removed as i will be using DeviceRecord structure instead
 typedef struct UsbDevice {
 	EpInfo *epinfo; // endpoint info pointer
@@ -79,6 +102,34 @@ typedef struct USB_DEVICE_DESCRIPTOR{
 	uint8_t bNumConfigurations; // Number of possible configurations.
 } __attribute__((packed)) USB_DEVICE_DESCRIPTOR;
 
+struct TransferRequest;
+typedef void (*TransferCallback)(struct TransferRequest* request, void* context);
+
+/* Asynchronous transfer request, submitted to MAX3421E::SubmitTransfer and completed from the USB task */
+typedef struct TransferRequest {
+	EpInfo* ep;					// Endpoint to transfer to or from
+	uint8_t address;			// Device address
+	uint8_t token;				// IN_TOKEN, OUT_TOKEN or SETUP_TOKEN for a control transfer
+	uint8_t* setup;				// 8 byte setup packet of a control transfer (direction is taken from bmRequestType)
+	uint8_t* data;				// Data to send or buffer for received data
+	uint16_t length;			// Number of bytes to transfer
+	uint16_t actual;			// Number of bytes transferred
+	uint8_t naklimit;			// Amount of NAK's before giving up
+	uint8_t rcode;				// Host result code, valid when state is URB_DONE
+	volatile uint8_t state;		// URB_* state
+	TransferCallback callback;	// Called when the request is done (may be NULL)
+	void* context;				// Context passed to the callback
+	
+	/* Used by MAX3421E while the request is queued */
+	uint8_t stage;				// URB_STAGE_* of a control transfer
+	uint16_t nakCount;
+	uint16_t firstNak;			// Tick of the first NAK of the current packet
+	uint16_t retryTick;			// Tick the NAK'ed packet is relaunched (URB_BACKOFF)
+	uint8_t retryCount;
+	uint8_t pktSize;			// Size of the OUT packet on the wire
+	struct TransferRequest* next;
+} TransferRequest;
+
 typedef struct DeviceRecord {
 	EpInfo* epInfo;
 	uint8_t devAddress;
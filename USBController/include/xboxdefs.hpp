@@ -45,6 +45,14 @@ typedef struct XBOXInputRecord {
 #define BACKKEY				32
 #define STARTKEY			16
 
+/* Gamepad interface of the controller, its interrupt endpoints carry the input and output packets */
+#define XBOX_INTERFACE_CLASS		0xFF
+#define XBOX_INTERFACE_SUBCLASS		0x5D
+#define XBOX_INTERFACE_PROTOCOL		0x01
+
+/* Time the rumble motors run for a rumble request in ms */
+#define RUMBLE_DURATION 200
+
 /* Control packet types */
 #define RUMBLE_TYPE 0x00
 #define LED_TYPE	0x01
@@ -9,7 +9,6 @@
 #define F_CPU 16000000
 
 #include <avr/io.h>
-#include <util/delay.h>
 
 extern "C"{
 	#include "FreeRTOS.h"
@@ -26,26 +25,43 @@ extern "C"{
 #include "USBHost.hpp"
 #include "xboxdefs.hpp"
 
+/* One USBHost per MAX3421E, all polled by the same task */
+#define USB_HOSTS	1
+
 // Wrapper to use class method in task
 void usbHostProcessWrapper(void* param)
 {
+	USBHost** hosts = static_cast<USBHost**>(param);
+	
+#if USB_HOSTS > 1
+	/* A host blocking on its own chip would starve the others, so every host only polls and the task sleeps
+	   on the INT pins of all chips between rounds */
+	for (uint8_t i = 0; i < USB_HOSTS; i++)
+		hosts[i]->GetMax()->SetWaitBudget(0);
+#endif
+	
 	while(1){
-		static_cast<USBHost*>(param)->Process();
+		for (uint8_t i = 0; i < USB_HOSTS; i++)
+			hosts[i]->Process();
+#if USB_HOSTS > 1
+		MAX3421E::WaitForAnyEvent(1);
+#endif
 	}
 	vTaskDelete( NULL );
 }
 
 int main(void)
 {
-	USBHost usbHost;						// initializes in constructor
+	USBHost usbHost;						// initializes in constructor (chip select PL7, INT4)
+	
+	// More players are added as USBHost(&PORTx,pin,INTn) with their own chip select and INT line
+	USBHost* usbHosts[USB_HOSTS] = {&usbHost};
 	
 	TestCallback callbackClass(&usbHost);	// test callbacks from within class
 
-	_delay_ms(1000);
-
 	usbHost.AddCallback((CallbackFunction)&callbackClass.CallbackWrapper,&callbackClass);
 
-	int retcode = xTaskCreate(usbHostProcessWrapper,(const signed char*)"USBHOSTTASK",512,&usbHost,tskIDLE_PRIORITY,NULL);
+	int retcode = xTaskCreate(usbHostProcessWrapper,(const signed char*)"USBHOSTTASK",512,usbHosts,tskIDLE_PRIORITY,NULL);
 
 	vTaskStartScheduler();
 	